@@ -10,10 +10,14 @@
  *  see http://linuxtv.org/docs.php for more information
  */
 
+#define _GNU_SOURCE             /* sched_setaffinity() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
 
 #include <getopt.h>             /* getopt_long() */
 
@@ -25,12 +29,27 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include <linux/videodev2.h>
 #include <linux/fb.h>
+#include <linux/media.h>
+#include <linux/v4l2-subdev.h>
+
+#if defined(__SSE2__) && !defined(__aarch64__)
+#include <emmintrin.h>
+#endif
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
+#ifndef V4L2_PIX_FMT_Y10P
+#define V4L2_PIX_FMT_Y10P    v4l2_fourcc('Y', '1', '0', 'P') /* 10  Greyscale, MIPI RAW10 packed */
+#endif
+
 //#define FIELD V4L2_FIELD_INTERLACED
 #define FIELD V4L2_FIELD_NONE
 
@@ -69,7 +88,83 @@ static struct fb_var_screeninfo vinfo;
 static struct fb_fix_screeninfo finfo;
 static long int screensize = 0;
 static char *fbmem = 0;
+static int              daemon_mode;
+static char            *cmd_name;
+static int              cmd_fd = -1;
+static int              quit;
+static int              streaming[N_DEVS_MAX];
+static struct v4l2_pix_format pix[N_DEVS_MAX], pix_req[N_DEVS_MAX];
+static struct timeval   reconf_time[N_DEVS_MAX];
+static int              reconf_pending[N_DEVS_MAX];
+static int              parallel_start;
+static int              show_timeline;
+static pthread_t        start_thread[N_DEVS_MAX];
+static int              starting[N_DEVS_MAX];
+static int              start_pipe[2] = {-1, -1};
+
+/* Startup phases, each stamped when it completes */
+enum startup_phase {
+        PHASE_OPEN,
+        PHASE_INIT,
+        PHASE_STREAMON,
+        PHASE_FIRST_FRAME,
+        N_PHASES,
+};
 
+static const char      *phase_name[N_PHASES] = {"open", "init", "streamon", "first frame"};
+static struct timeval   start_time;
+static struct timeval   timeline[N_DEVS_MAX][N_PHASES];
+static int              first_frames;
+static int              failed[N_DEVS_MAX];
+static int              given_up[N_DEVS_MAX];
+static pthread_t        retry_thread[N_DEVS_MAX];
+static int              retrying[N_DEVS_MAX];
+static int              retry_result[N_DEVS_MAX];
+static unsigned int     retries[N_DEVS_MAX];
+static struct timeval   retry_time[N_DEVS_MAX];
+static unsigned int     retry_delay[N_DEVS_MAX];
+static struct timeval   last_frame[N_DEVS_MAX];
+static struct timeval   outage_start[N_DEVS_MAX];
+static unsigned int     outages[N_DEVS_MAX];
+static unsigned long    outage_usec[N_DEVS_MAX];
+static char            *bench_name;
+static int              rt_prio;
+static char            *rt_cpus;
+static cpu_set_t        rt_all_cpus;    /* before -a pinned the capture thread */
+static int              rt_pinned;
+static int              stress_threads;
+static int              jitter;
+static unsigned int    *jitter_hist[N_DEVS_MAX];
+static struct timespec  dq_time[N_DEVS_MAX];
+static unsigned long    dq_min[N_DEVS_MAX], dq_max[N_DEVS_MAX];
+static unsigned long long dq_sum[N_DEVS_MAX];
+static unsigned long    dq_n[N_DEVS_MAX];
+static char            *tonemap_name = "shift";
+static char            *replay_name;
+static char            *trace_name;
+static int              replay_fps = -1;
+static char            *rec_name;
+static char            *unpack_name;
+static int              rec_workers;
+static int              rec_predict;
+static char            *calib_name;
+static char            *topology_name;
+static int              remap_threads;
+static int              pyramid_levels;
+static int              pyramid_out = -1;
+static unsigned int     tonemap_lut[4096];
+static int              tonemap_bits;
+static int              tonemap_shift;
+static int              inject_dev = -1;
+static unsigned int     inject_period;
+
+static void handle_commands(void);
+static void device_failed(int dev, const char *what);
+static void check_devices(void);
+static void restart_done(int dev);
+static void unpin_thread(void);
+static void next_retry(struct timeval *tv);
+static void prefault_device(int dev);
 
 static void errno_exit(const char *s)
 {
@@ -77,6 +172,12 @@ static void errno_exit(const char *s)
         exit(EXIT_FAILURE);
 }
 
+static int errno_fail(int dev, const char *s)
+{
+        fprintf(stderr, "%s: %s error %d, %s\n", dev_name[dev], s, errno, strerror(errno));
+        return -1;
+}
+
 static int xioctl(int fh, int request, void *arg)
 {
         int r;
@@ -93,6 +194,211 @@ static inline unsigned long uSecElapsed(struct timeval *t2, struct timeval *t1)
         return (t2->tv_sec - t1->tv_sec) * 1000000 + t2->tv_usec - t1->tv_usec;
 }
 
+/* Now on the clock V4L2 stamps buffers with, for frames that come without */
+static void monotonic_timeval(struct timeval *tv)
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        tv->tv_sec = t.tv_sec;
+        tv->tv_usec = t.tv_nsec / 1000;
+}
+
+/*
+ * Dequeue interval statistics. Intervals are kept in a histogram of
+ * JITTER_BIN us bins, so percentiles are accurate to one bin.
+ */
+#define JITTER_BIN      10              /* us */
+#define JITTER_BINS     20000           /* up to 200 ms */
+
+static void record_dequeue(int dev)
+{
+        struct timespec t;
+        unsigned long usec;
+
+        if (!jitter)
+                return;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        if (dq_time[dev].tv_sec) {
+                usec = (t.tv_sec - dq_time[dev].tv_sec) * 1000000 +
+                       (t.tv_nsec - dq_time[dev].tv_nsec) / 1000;
+
+                if (!dq_n[dev] || usec < dq_min[dev])
+                        dq_min[dev] = usec;
+                if (usec > dq_max[dev])
+                        dq_max[dev] = usec;
+                dq_sum[dev] += usec;
+                dq_n[dev]++;
+                jitter_hist[dev][usec / JITTER_BIN < JITTER_BINS ? usec / JITTER_BIN : JITTER_BINS - 1]++;
+        }
+        dq_time[dev] = t;
+}
+
+static void print_jitter(void)
+{
+        unsigned long seen, p999;
+        int dev, bin;
+
+        if (!jitter)
+                return;
+
+        fprintf(stderr, "dequeue interval (us):\n");
+        for (dev = 0; dev < n_devs; dev++) {
+                if (!dq_n[dev])
+                        continue;
+
+                /* Upper edge of the bin holding the 99.9th percentile */
+                for (bin = 0, seen = 0; bin < JITTER_BINS - 1; bin++) {
+                        seen += jitter_hist[dev][bin];
+                        if (seen * 1000 >= dq_n[dev] * 999)
+                                break;
+                }
+                p999 = bin < JITTER_BINS - 1 ? (unsigned long)(bin + 1) * JITTER_BIN : dq_max[dev];
+
+                fprintf(stderr, "%-12s min %6lu avg %6llu max %6lu p99.9 %6lu jitter %6lu (%lu frames)\n",
+                        dev_name[dev], dq_min[dev], dq_sum[dev] / dq_n[dev], dq_max[dev],
+                        p999, dq_max[dev] - dq_min[dev], dq_n[dev]);
+        }
+}
+
+/*
+ * Per-frame tracing. Each stage of a frame is bracketed by begin/end
+ * events, written either to the ftrace trace_marker (systrace format, so
+ * it lines up with the VIN/VSP trace points in the same capture) or to a
+ * Chrome/Perfetto JSON file with one track per device. When tracing is
+ * off every TRACE_BEGIN/TRACE_END is a single untaken branch.
+ */
+enum trace_stage {
+        TRACE_SELECT,
+        TRACE_DQBUF,
+        TRACE_PROCESS,
+        TRACE_FB,
+        TRACE_QBUF,
+        N_TRACE_STAGES,
+};
+
+static const char      *trace_stage_name[N_TRACE_STAGES] = {"select", "dqbuf", "process", "fb", "qbuf"};
+static int              trace_on;
+static int              trace_fd = -1;
+static FILE            *trace_fp;
+static struct timespec  trace_start;
+static unsigned int     trace_seq[N_DEVS_MAX];
+
+#define TRACE_BEGIN(stage, dev) \
+        do { if (__builtin_expect(trace_on, 0)) trace_event(stage, dev, 'B'); } while (0)
+#define TRACE_END(stage, dev) \
+        do { if (__builtin_expect(trace_on, 0)) trace_event(stage, dev, 'E'); } while (0)
+
+/* @dev -1 is the main loop itself; dqbuf doesn't know its sequence number before it ends */
+static void trace_event(enum trace_stage stage, int dev, char ph)
+{
+        struct timespec t;
+        char ev[256];
+        int n;
+
+        if (-1 != trace_fd) {
+                if ('E' == ph)
+                        n = snprintf(ev, sizeof(ev), "E|%d", getpid());
+                else if (dev < 0)
+                        n = snprintf(ev, sizeof(ev), "B|%d|capture %s", getpid(), trace_stage_name[stage]);
+                else if (TRACE_DQBUF == stage)
+                        n = snprintf(ev, sizeof(ev), "B|%d|capture %s %s", getpid(),
+                                    trace_stage_name[stage], dev_name[dev]);
+                else
+                        n = snprintf(ev, sizeof(ev), "B|%d|capture %s %s #%u", getpid(),
+                                    trace_stage_name[stage], dev_name[dev], trace_seq[dev]);
+                if (n >= (int)sizeof(ev))
+                        n = sizeof(ev) - 1;
+                if (n != write(trace_fd, ev, n))
+                        trace_on = 0;
+                return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        fprintf(trace_fp, ",\n{\"name\":\"%s\",\"cat\":\"capture\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d",
+                trace_stage_name[stage], ph,
+                (t.tv_sec - trace_start.tv_sec) * 1e6 + (t.tv_nsec - trace_start.tv_nsec) / 1e3,
+                getpid(), dev + 1);
+        if (dev >= 0 && (TRACE_DQBUF != stage || 'E' == ph))
+                fprintf(trace_fp, ",\"args\":{\"seq\":%u}", trace_seq[dev]);
+        fputs("}", trace_fp);
+}
+
+/* Also run by exit(), so a run that fails still leaves a JSON file that loads */
+static void close_trace(void)
+{
+        trace_on = 0;
+
+        if (-1 != trace_fd) {
+                close(trace_fd);
+                trace_fd = -1;
+        }
+
+        if (trace_fp) {
+                fputs("\n]}\n", trace_fp);
+                fclose(trace_fp);
+                trace_fp = NULL;
+        }
+}
+
+static void open_trace(const char *name)
+{
+        static const char *marker[] = {
+                "/sys/kernel/tracing/trace_marker",
+                "/sys/kernel/debug/tracing/trace_marker",
+        };
+        unsigned int i;
+        int dev;
+
+        if (!strcmp(name, "ftrace")) {
+                for (i = 0; i < sizeof(marker) / sizeof(marker[0]) && -1 == trace_fd; i++)
+                        trace_fd = open(marker[i], O_WRONLY);
+                if (-1 == trace_fd) {
+                        fprintf(stderr, "Cannot open trace_marker: %d, %s\n", errno, strerror(errno));
+                        exit(EXIT_FAILURE);
+                }
+                trace_on = 1;
+                atexit(close_trace);
+                return;
+        }
+
+        trace_fp = fopen(name, "w");
+        if (!trace_fp) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &trace_start);
+        fprintf(trace_fp, "{\"traceEvents\":[\n"
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"main loop\"}}",
+                getpid());
+        for (dev = 0; dev < n_devs; dev++)
+                fprintf(trace_fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"name\":\"%s\"}}", getpid(), dev + 1, dev_name[dev]);
+        trace_on = 1;
+        atexit(close_trace);
+}
+
+static void print_timeline(void)
+{
+        int dev, phase;
+
+        fprintf(stderr, "startup timeline (ms since start):\n");
+        for (dev = 0; dev < n_devs; dev++) {
+                fprintf(stderr, "%-12s", dev_name[dev]);
+                for (phase = 0; phase < N_PHASES; phase++) {
+                        if (timeline[dev][phase].tv_sec)
+                                fprintf(stderr, " %s %8.1f", phase_name[phase],
+                                        uSecElapsed(&timeline[dev][phase], &start_time) / 1000.0);
+                        else
+                                fprintf(stderr, " %s        -", phase_name[phase]);
+                }
+                fprintf(stderr, "\n");
+        }
+}
+
 static void fpsCount(int dev)
 {
         static unsigned frames[N_DEVS_MAX];
@@ -136,672 +442,4303 @@ static inline void yuv_to_rgb32(unsigned short y,
     *rgb   = 0; //A
 }
 
-static void process_image(const void *p, int size, int dev)
-{
-        if (out_buf)
-                fwrite(p, size, 1, stdout);
+/*
+ * Framebuffer blitting.
+ *
+ * The framebuffer is normally mapped write-combined or uncached, so byte
+ * stores straight into it each become a bus transaction. Lines are
+ * converted into a cacheable per-thread scratch line instead and copied
+ * out with aligned 16 byte stores, 64 bytes at a time so that every burst
+ * fills a whole write-combining buffer.
+ */
+typedef unsigned int v4u32 __attribute__((vector_size(16)));
 
-        if (out_fb) {
-            if (!strncmp(format_name, "rgb32", 5) | !strncmp(format_name, "raw10", 5)) {
-                /* for RGB32 from camera: no need any convertion */
-                int i;
-                int offset = (WIDTH*4)*(dev%(n_devs > 4 ? 4 : 2)) + (HEIGHT*finfo.line_length)*(dev/(n_devs > 4 ? 4 : 2));
-                unsigned char *fbp = (unsigned char *)fbmem + offset;
-                char *buf = (char *)p;
+static __thread unsigned char *scratch;
+static __thread size_t scratch_size;
 
-                for (i = 0; i < HEIGHT; i++) {
-                        memcpy(fbp, buf, WIDTH*4);
-                        fbp += finfo.line_length;
-                        buf += (WIDTH*4);
+static unsigned char *get_scratch(size_t size)
+{
+        if (size > scratch_size) {
+                free(scratch);
+                if (posix_memalign((void **)&scratch, 64, size)) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
                 }
-            } else if (!strncmp(format_name, "uyvy", 4)) {
-                /* for UYVY from camera: covert UYVY to RGB32 */
-                int i, j;
-                unsigned char *fbp = (unsigned char *)fbmem;
-                char *buf = (char *)p;
-                unsigned short Y1, Y2, U, V;
-
-                // assume bpp = 32
-                for (i = 0; i < HEIGHT; i++) {
-                        for (j = 0; j < WIDTH*4; j+=4) {
-                                U = (buf[j + 1] << 8) + buf[j + 0];
-                                Y1 = (buf[j + 3] << 8) + buf[j + 2];
-                                V = (buf[j + 5] << 8) + buf[j + 4];
-                                Y2 = (buf[j + 7] << 8) + buf[j + 6];
-
-                                yuv_to_rgb32(Y1, U, V, &fbp[2*j]);
-                                yuv_to_rgb32(Y2, U, V, &fbp[2*(j + 2)]);
-                        }
-
-                        fbp += finfo.line_length;
-                        buf += (WIDTH*2);
-                }
-            } else if (!strncmp(format_name, "bggr8", 5)) {
-            } else if (!strncmp(format_name, "bggr12", 6)) {
-                int i, j, k;
-                unsigned char *fbp = (unsigned char *)fbmem;
-                char *buf = (char *)p;
-
-                for (i = 0; i < HEIGHT; i++) {
-                        k = 0;
-                        for (j = 0; j < WIDTH; j+=3) {
-                                if (i & 1) {
-                                        /* GR row */
-                                        fbp[k++] = buf[j-WIDTH]; //B
-                                        fbp[k++] = buf[j+0]; //G
-                                        fbp[k++] = buf[j+1]; //R
-                                        fbp[k++] = 0; //A
-
-                                        fbp[k++] = buf[j-WIDTH]; //B
-                                        fbp[k++] = buf[j+0]; //G
-                                        fbp[k++] = buf[j+1]; //R
-                                        fbp[k++] = 0; //A
-                                } else {
-                                        /* BG row */
-                                        fbp[k++] = buf[j+0]; //B
-                                        fbp[k++] = buf[j+1]; //G
-                                        fbp[k++] = buf[j+WIDTH+1]; //R
-                                        fbp[k++] = 0; //A
-
-                                        fbp[k++] = buf[j+0]; //B
-                                        fbp[k++] = buf[j+1]; //G
-                                        fbp[k++] = buf[j+WIDTH+1]; //R
-                                        fbp[k++] = 0; //A
-                                }
-                        }
+                scratch_size = size;
+        }
 
-                        fbp += finfo.line_length;
-                        buf += WIDTH;
-                }
-            } else {
-                fprintf(stderr, "format not supported to stream to Framebuffer\n");
-            }
+        return scratch;
+}
+
+static inline void store64(unsigned char *d, v4u32 a, v4u32 b, v4u32 c, v4u32 e)
+{
+#if defined(__aarch64__)
+        /* Non-temporal pair stores, don't pull the framebuffer into the cache */
+        asm volatile("stnp %q0, %q1, [%2]\n\t"
+                     "stnp %q3, %q4, [%2, #32]"
+                     : : "w" (a), "w" (b), "r" (d), "w" (c), "w" (e) : "memory");
+#elif defined(__SSE2__)
+        _mm_stream_si128((__m128i *)d, (__m128i)a);
+        _mm_stream_si128((__m128i *)d + 1, (__m128i)b);
+        _mm_stream_si128((__m128i *)d + 2, (__m128i)c);
+        _mm_stream_si128((__m128i *)d + 3, (__m128i)e);
+#else
+        ((v4u32 *)d)[0] = a;
+        ((v4u32 *)d)[1] = b;
+        ((v4u32 *)d)[2] = c;
+        ((v4u32 *)d)[3] = e;
+#endif
+}
+
+static void blit_line(void *dst, const void *src, size_t len)
+{
+        unsigned char *d = dst;
+        const unsigned char *s = src;
+        size_t head = -(unsigned long)d & 15;
+        v4u32 a, b, c, e;
+
+        /* Head up to 16 byte alignment of the destination */
+        if (head > len)
+                head = len;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        len -= head;
+
+        for (; len >= 64; len -= 64, d += 64, s += 64) {
+                memcpy(&a, s, 16);
+                memcpy(&b, s + 16, 16);
+                memcpy(&c, s + 32, 16);
+                memcpy(&e, s + 48, 16);
+                store64(d, a, b, c, e);
         }
+
+        for (; len >= 16; len -= 16, d += 16, s += 16) {
+                memcpy(&a, s, 16);
+                *(v4u32 *)d = a;
+        }
+
+        if (len)
+                memcpy(d, s, len);
 }
 
-static int read_frame(int dev)
+/* Order the non-temporal stores of a frame before it is handed back */
+static inline void blit_flush(void)
 {
-        struct v4l2_buffer buf;
-        unsigned int i;
+#if defined(__SSE2__) && !defined(__aarch64__)
+        _mm_sfence();
+#endif
+}
 
-        switch (io) {
-        case IO_METHOD_READ:
-                if (-1 == read(fd[dev], (buffers[dev])[0].start, (buffers[dev])[0].length)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
-                                /* fall through */
-                        default:
-                                errno_exit("read");
-                        }
-                }
+/*
+ * Framebuffer area of the tile showing @dev, clipped to the screen.
+ * The screen is split in 2 columns, or 4 with more than 4 devices.
+ */
+static unsigned char *fb_tile(int dev, int *w, int *h)
+{
+        int cols = n_devs > 4 ? 4 : 2;
+        int x = WIDTH * (dev % cols);
+        int y = HEIGHT * (dev / cols);
 
-                process_image((buffers[dev])[0].start, (buffers[dev])[0].length, dev);
-                break;
+        *w = WIDTH;
+        if (x + *w > (int)finfo.line_length / 4)
+                *w = finfo.line_length / 4 - x;
 
-        case IO_METHOD_MMAP:
-                CLEAR(buf);
+        *h = HEIGHT;
+        if (y + *h > screensize / finfo.line_length)
+                *h = screensize / finfo.line_length - y;
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
+        if (*w < 0)
+                *w = 0;
+        if (*h < 0)
+                *h = 0;
 
-                if (-1 == xioctl(fd[dev], VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
-                                /* fall through */
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
-                        }
-                }
+        return (unsigned char *)fbmem + y * finfo.line_length + x * 4;
+}
 
-                assert(buf.index < n_buffers[dev]);
+/* UYVY 4:2:2 to 32 bit BGRX */
+static void uyvy_to_rgb32(const unsigned char *buf, unsigned char *rgb, int width)
+{
+        int j;
 
-                process_image((buffers[dev])[buf.index].start, buf.bytesused, dev);
+        for (j = 0; j + 1 < width; j += 2, buf += 4, rgb += 8) {
+                yuv_to_rgb32(buf[1] << 2, buf[0] << 2, buf[2] << 2, rgb);
+                yuv_to_rgb32(buf[3] << 2, buf[0] << 2, buf[2] << 2, rgb + 4);
+        }
+}
 
-                if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
+/*
+ * A BG/GR row pair of 8 bit (@bytes = 1) or 12 bit (@bytes = 2) BGGR Bayer
+ * to 32 bit BGRX, each 2x2 quad becomes one colour.
+ */
+static void bggr_to_rgb32(const unsigned char *bg, const unsigned char *gr,
+                          unsigned char *rgb, int width, int bytes)
+{
+        const unsigned short *bg16 = (const unsigned short *)bg;
+        const unsigned short *gr16 = (const unsigned short *)gr;
+        unsigned char b, g, r;
+        int j;
+
+        for (j = 0; j + 1 < width; j += 2, rgb += 8) {
+                if (bytes == 2) {
+                        b = bg16[j] >> 4;
+                        g = (bg16[j + 1] + gr16[j]) >> 5;
+                        r = gr16[j + 1] >> 4;
+                } else {
+                        b = bg[j];
+                        g = (bg[j + 1] + gr[j]) >> 1;
+                        r = gr[j + 1];
+                }
 
-        case IO_METHOD_USERPTR:
-                CLEAR(buf);
+                rgb[0] = rgb[4] = b;
+                rgb[1] = rgb[5] = g;
+                rgb[2] = rgb[6] = r;
+                rgb[3] = rgb[7] = 0;
+        }
+}
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
+/*
+ * 10/12 bit greyscale (Y10, Y10P, Y12) to display.
+ *
+ * Samples are tone mapped to 8 bit grey through a lookup table built for
+ * the sample depth; a plain shift, the default, also has a vector path.
+ */
+typedef unsigned short v8u16 __attribute__((vector_size(16)));
+typedef unsigned int v8u32 __attribute__((vector_size(32)));
 
-                if (-1 == xioctl(fd[dev], VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
-                                /* fall through */
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
+static void build_tonemap(int bits)
+{
+        int max = (1 << bits) - 1;
+        double gamma;
+        FILE *fp;
+        int i, v;
+
+        tonemap_shift = -1;
+
+        if (!strncmp(tonemap_name, "shift", 5)) {
+                tonemap_shift = bits - 8;
+                sscanf(tonemap_name, "shift:%d", &tonemap_shift);
+                if (tonemap_shift < 0 || tonemap_shift > 15) {
+                        fprintf(stderr, "invalid tone mapping '%s'\n", tonemap_name);
+                        exit(EXIT_FAILURE);
+                }
+                for (i = 0; i < 4096; i++) {
+                        v = i >> tonemap_shift;
+                        tonemap_lut[i] = v > 255 ? 255 : v;
+                }
+        } else if (1 == sscanf(tonemap_name, "gamma:%lf", &gamma) && gamma > 0) {
+                for (i = 0; i < 4096; i++) {
+                        v = 255 * pow((i > max ? max : i) / (double)max, 1 / gamma) + 0.5;
+                        tonemap_lut[i] = v;
+                }
+        } else if (!strncmp(tonemap_name, "lut:", 4)) {
+                /* One output value per line, missing entries repeat the last one */
+                fp = fopen(tonemap_name + 4, "r");
+                if (!fp) {
+                        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                                 tonemap_name + 4, errno, strerror(errno));
+                        exit(EXIT_FAILURE);
+                }
+                for (i = 0, v = 0; i < 4096; i++) {
+                        if (1 != fscanf(fp, "%d", &v) && !i) {
+                                fprintf(stderr, "%s: no values\n", tonemap_name + 4);
+                                exit(EXIT_FAILURE);
                         }
+                        tonemap_lut[i] = v < 0 ? 0 : v > 255 ? 255 : v;
                 }
+                fclose(fp);
+        } else {
+                fprintf(stderr, "invalid tone mapping '%s'\n", tonemap_name);
+                exit(EXIT_FAILURE);
+        }
 
-                for (i = 0; i < n_buffers[dev]; ++i)
-                        if (buf.m.userptr == (unsigned long)(buffers[dev])[i].start
-                            && buf.length == (buffers[dev])[i].length)
-                                break;
+        /* Grey to BGRX */
+        for (i = 0; i < 4096; i++)
+                tonemap_lut[i] *= 0x010101;
 
-                assert(i < n_buffers[dev]);
+        tonemap_bits = bits;
+}
 
-                process_image((void *)buf.m.userptr, buf.bytesused, dev);
+/* MIPI RAW10: 4 pixels in 5 bytes, the high 8 bits first, then 2 low bits each */
+static void y10p_unpack(const unsigned char *src, unsigned short *dst, int width)
+{
+        int j;
 
-                if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
+        for (j = 0; j + 3 < width; j += 4, src += 5, dst += 4) {
+                dst[0] = (src[0] << 2) | (src[4] & 3);
+                dst[1] = (src[1] << 2) | ((src[4] >> 2) & 3);
+                dst[2] = (src[2] << 2) | ((src[4] >> 4) & 3);
+                dst[3] = (src[3] << 2) | (src[4] >> 6);
         }
+}
 
-        if (fps_count)
-                fpsCount(dev);
+static void grey16_to_rgb32(const unsigned short *src, unsigned int *dst, int width)
+{
+        v8u16 x, m, limit = { 255, 255, 255, 255, 255, 255, 255, 255 };
+        v8u32 y;
+        int j = 0;
+
+        if (tonemap_shift >= 0) {
+                for (; j + 7 < width; j += 8) {
+                        memcpy(&x, src + j, sizeof(x));
+                        x >>= tonemap_shift;
+                        m = x > limit;
+                        x = (x & ~m) | (limit & m);
+                        y = __builtin_convertvector(x, v8u32) * 0x010101;
+                        memcpy(dst + j, &y, sizeof(y));
+                }
+        }
 
-        return 1;
+        for (; j < width; j++)
+                dst[j] = tonemap_lut[src[j] & 0xfff];
 }
 
-#define max(a,b) (a>b?a:b)
+/* With the default shift Y10P only needs the high bytes */
+static void y10p_to_rgb32(const unsigned char *src, unsigned int *dst,
+                          unsigned short *tmp, int width)
+{
+        int j;
+
+        if (tonemap_shift == 2) {
+                for (j = 0; j + 3 < width; j += 4, src += 5, dst += 4) {
+                        dst[0] = src[0] * 0x010101;
+                        dst[1] = src[1] * 0x010101;
+                        dst[2] = src[2] * 0x010101;
+                        dst[3] = src[3] * 0x010101;
+                }
+        } else {
+                y10p_unpack(src, tmp, width);
+                grey16_to_rgb32(tmp, dst, width);
+        }
+}
 
-static void mainloop(void)
+static int grey_bits(void)
 {
-        unsigned int count = frame_count;
-        int dev = 0;
-        fd_set fds;
-        struct timeval tv;
-        int r;
+        return !strncmp(format_name, "y12", 3) ? 12 : 10;
+}
 
-        /* Give time to queue buffers at start streaming by VIN module */
-//        usleep(34000*3);
+/*
+ * Image pyramid: 1/2, 1/4 and 1/8 scale copies of every frame for
+ * analytics consumers, built by 2x2 box filtering.
+ *
+ * The source is walked once, in bands of 2^levels rows: each band first
+ * produces its level 1 rows, and the next levels are reduced from those
+ * while they are still in the cache.
+ */
+#define PYRAMID_MAX     3
 
-        while (count-- > 0) {
-                for (;;) {
-                        FD_ZERO(&fds);
+typedef unsigned char v16u8 __attribute__((vector_size(16)));
+typedef unsigned short v16u16 __attribute__((vector_size(32)));
 
-                        for (dev = 0; dev < n_devs; dev++)
-                                FD_SET(fd[dev], &fds);
-                        /* Timeout. */
-                        tv.tv_sec = timeout;
-                        tv.tv_usec = 0;
+struct pyramid_level {
+        unsigned char  *data;
+        int             width;
+        int             height;
+        int             stride;         /* bytes */
+        size_t          size;           /* allocated */
+};
 
-                        r = select(max(max(max(max(fd[0],fd[1]),max(fd[2],fd[3])),max(max(fd[4],fd[5]),max(fd[6],fd[7]))),max(max(fd[8],fd[9]),max(fd[10],fd[11]))) + 1, &fds, NULL, NULL, &tv);
-//                        r = select((max(max(max(fd[0],fd[1]),max(fd[2],fd[3])),max(max(fd[4],fd[5]),max(fd[6],fd[7]))),max(max(fd[8],fd[9]),max(fd[10],fd[11]))) + 1, &fds, NULL, NULL, &tv);
-                        if (-1 == r) {
-                                if (EINTR == errno)
-                                        continue;
-                                errno_exit("select");
-                        }
+static struct pyramid_level pyramid[N_DEVS_MAX][PYRAMID_MAX];
 
-                        if (0 == r) {
-                                fprintf(stderr, "select timeout\n");
-                                exit(EXIT_FAILURE);
-                        }
+/*
+ * 2:1 reduction of a pixel format: output byte k of every 16 averages
+ * input bytes a[k] and b[k] of the matching 32 in both rows. 16 bit
+ * formats are reduced by samples instead.
+ */
+struct pyramid_format {
+        const char     *name;
+        int             bpp;            /* bytes per pixel */
+        int             wide;           /* 16 bit samples */
+        int             pairs;          /* width must stay even, 4:2:2 */
+        unsigned char   a[16], b[16];
+};
 
-                        r = 0;
-                        for (dev = 0; dev < n_devs; dev++) {
-                                if (FD_ISSET(fd[dev], &fds))
-                                        r += read_frame(dev);
-//                                        usleep(30000);
-                        }
-                        if (r)
-                                break;
-                        /* EAGAIN - continue select loop. */
-                }
-        }
+static const struct pyramid_format pyramid_formats[] = {
+        { "rgb32", 4, 0, 0,
+          { 0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27 },
+          { 4, 5, 6, 7, 12, 13, 14, 15, 20, 21, 22, 23, 28, 29, 30, 31 } },
+        { "raw10", 4, 0, 0,
+          { 0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27 },
+          { 4, 5, 6, 7, 12, 13, 14, 15, 20, 21, 22, 23, 28, 29, 30, 31 } },
+        /* U Y0 V Y1: chroma from both macropixels, Y0' = Y0+Y1 of the first, Y1' of the second */
+        { "uyvy", 2, 0, 1,
+          { 0, 1, 2, 5, 8, 9, 10, 13, 16, 17, 18, 21, 24, 25, 26, 29 },
+          { 4, 3, 6, 7, 12, 11, 14, 15, 20, 19, 22, 23, 28, 27, 30, 31 } },
+        { "yuyv", 2, 0, 1,
+          { 0, 1, 4, 3, 8, 9, 12, 11, 16, 17, 20, 19, 24, 25, 28, 27 },
+          { 2, 5, 6, 7, 10, 13, 14, 15, 18, 21, 22, 23, 26, 29, 30, 31 } },
+        { "grey", 1, 0, 0,
+          { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 },
+          { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31 } },
+        { "y10", 2, 1, 0, { 0 }, { 0 } },
+        { "y12", 2, 1, 0, { 0 }, { 0 } },
+};
+
+static const struct pyramid_format *get_pyramid_format(void)
+{
+        unsigned int i;
+
+        /* Packed Y10P and Bayer have no 2x2 reduction here */
+        if (!strncmp(format_name, "y10p", 4))
+                return NULL;
+
+        for (i = 0; i < sizeof(pyramid_formats) / sizeof(pyramid_formats[0]); i++)
+                if (!strncmp(format_name, pyramid_formats[i].name, strlen(pyramid_formats[i].name)))
+                        return &pyramid_formats[i];
+
+        return NULL;
 }
 
-static void stop_capturing(int dev)
+static void down2_row8(const unsigned char *r0, const unsigned char *r1,
+                       unsigned char *d, int n, const struct pyramid_format *f)
 {
-        enum v4l2_buf_type type;
+        v16u8 ma, mb, a0, b0, a1, b1, out;
+        v16u16 sum;
+        int j = 0, k;
+
+        memcpy(&ma, f->a, sizeof(ma));
+        memcpy(&mb, f->b, sizeof(mb));
+
+        for (; j + 16 <= n; j += 16, r0 += 32, r1 += 32, d += 16) {
+                memcpy(&a0, r0, 16);
+                memcpy(&b0, r0 + 16, 16);
+                memcpy(&a1, r1, 16);
+                memcpy(&b1, r1 + 16, 16);
+                sum = __builtin_convertvector(__builtin_shuffle(a0, b0, ma), v16u16) +
+                      __builtin_convertvector(__builtin_shuffle(a0, b0, mb), v16u16) +
+                      __builtin_convertvector(__builtin_shuffle(a1, b1, ma), v16u16) +
+                      __builtin_convertvector(__builtin_shuffle(a1, b1, mb), v16u16);
+                out = __builtin_convertvector((sum + 2) >> 2, v16u8);
+                memcpy(d, &out, 16);
+        }
 
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
+        /* The byte patterns repeat every pixel, so they also cover the tail */
+        for (k = 0; j < n; j++, k++)
+                d[k] = (r0[f->a[k]] + r0[f->b[k]] + r1[f->a[k]] + r1[f->b[k]] + 2) >> 2;
+}
 
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd[dev], VIDIOC_STREAMOFF, &type))
-                        errno_exit("VIDIOC_STREAMOFF");
-                break;
+static void down2_row16(const unsigned short *r0, const unsigned short *r1,
+                        unsigned short *d, int n)
+{
+        const v8u16 even = { 0, 2, 4, 6, 8, 10, 12, 14 };
+        const v8u16 odd = { 1, 3, 5, 7, 9, 11, 13, 15 };
+        v8u16 a0, b0, a1, b1, out;
+        v8u32 sum;
+        int j = 0;
+
+        for (; j + 8 <= n; j += 8, r0 += 16, r1 += 16, d += 8) {
+                memcpy(&a0, r0, 16);
+                memcpy(&b0, r0 + 8, 16);
+                memcpy(&a1, r1, 16);
+                memcpy(&b1, r1 + 8, 16);
+                sum = __builtin_convertvector(__builtin_shuffle(a0, b0, even), v8u32) +
+                      __builtin_convertvector(__builtin_shuffle(a0, b0, odd), v8u32) +
+                      __builtin_convertvector(__builtin_shuffle(a1, b1, even), v8u32) +
+                      __builtin_convertvector(__builtin_shuffle(a1, b1, odd), v8u32);
+                out = __builtin_convertvector((sum + 2) >> 2, v8u16);
+                memcpy(d, &out, 16);
         }
+
+        for (; j < n; j++, r0 += 2, r1 += 2, d++)
+                *d = (r0[0] + r0[1] + r1[0] + r1[1] + 2) >> 2;
 }
 
-static void start_capturing(int dev)
+/* Rows [@begin, @end) of @lv, reduced from @in with @in_stride bytes per row */
+static void pyramid_rows(const struct pyramid_format *f, struct pyramid_level *lv,
+                         const unsigned char *in, int in_stride, int begin, int end)
 {
-        unsigned int i;
-        enum v4l2_buf_type type;
+        const unsigned char *r0;
+        unsigned char *d;
+        int r;
 
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
+        for (r = begin; r < end; r++) {
+                r0 = in + 2 * r * in_stride;
+                d = lv->data + r * lv->stride;
+                if (f->wide)
+                        down2_row16((const unsigned short *)r0,
+                                    (const unsigned short *)(r0 + in_stride),
+                                    (unsigned short *)d, lv->width);
+                else
+                        down2_row8(r0, r0 + in_stride, d, lv->width * f->bpp, f);
+        }
+}
 
-        case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers[dev]; ++i) {
-                        struct v4l2_buffer buf;
+/* Size the pool buffers of @dev for the current geometry */
+static void pyramid_setup(const struct pyramid_format *f, int dev)
+{
+        struct pyramid_level *lv;
+        int l, w = WIDTH, h = HEIGHT;
+        size_t size;
+
+        for (l = 0; l < pyramid_levels; l++) {
+                lv = &pyramid[dev][l];
+                w >>= 1;
+                if (f->pairs)
+                        w &= ~1;
+                h >>= 1;
+
+                lv->width = w;
+                lv->height = h;
+                lv->stride = w * f->bpp;
+                size = (size_t)lv->stride * h;
+                if (size > lv->size) {
+                        free(lv->data);
+                        if (posix_memalign((void **)&lv->data, 64, size)) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        lv->size = size;
+                }
+        }
+}
 
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_MMAP;
-                        buf.index = i;
+static void build_pyramid(const unsigned char *src, int dev)
+{
+        const struct pyramid_format *f = get_pyramid_format();
+        struct pyramid_level *lv;
+        const unsigned char *in;
+        int band = 1 << pyramid_levels;
+        int y, l, in_stride, begin, end;
+        static int warned;
+
+        if (!f) {
+                if (!warned++)
+                        fprintf(stderr, "format not supported for pyramid\n");
+                return;
+        }
 
-                        if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
-                                errno_exit("VIDIOC_QBUF");
+        pyramid_setup(f, dev);
+
+        for (y = 0; y < HEIGHT; y += band) {
+                in = src;
+                in_stride = WIDTH * f->bpp;
+                for (l = 0; l < pyramid_levels; l++) {
+                        lv = &pyramid[dev][l];
+                        begin = y >> (l + 1);
+                        end = (y + band) >> (l + 1);
+                        if (end > lv->height)
+                                end = lv->height;
+                        pyramid_rows(f, lv, in, in_stride, begin, end);
+                        in = lv->data;
+                        in_stride = lv->stride;
                 }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd[dev], VIDIOC_STREAMON, &type))
-                        errno_exit("VIDIOC_STREAMON");
+        }
+}
+
+/* A frame in the capture format to 32 bit BGRX at @fbp, @w x @h of it */
+static void convert_frame(const unsigned char *buf, unsigned char *fbp, long stride, int w, int h)
+{
+        unsigned char *line;
+        int i, bytes;
+
+        if (!strncmp(format_name, "rgb32", 5) | !strncmp(format_name, "raw10", 5)) {
+                /* for RGB32 from camera: no need any convertion */
+                for (i = 0; i < h; i++) {
+                        blit_line(fbp, buf, w * 4);
+                        fbp += stride;
+                        buf += WIDTH * 4;
+                }
+        } else if (!strncmp(format_name, "uyvy", 4)) {
+                /* for UYVY from camera: covert UYVY to RGB32 */
+                line = get_scratch(w * 4);
+                for (i = 0; i < h; i++) {
+                        uyvy_to_rgb32(buf, line, w);
+                        blit_line(fbp, line, w * 4);
+                        fbp += stride;
+                        buf += WIDTH * 2;
+                }
+        } else if (!strncmp(format_name, "bggr8", 5) || !strncmp(format_name, "bggr12", 6)) {
+                bytes = !strncmp(format_name, "bggr8", 5) ? 1 : 2;
+                line = get_scratch(w * 4);
+                for (i = 0; i + 1 < h; i += 2) {
+                        bggr_to_rgb32(buf, buf + WIDTH * bytes, line, w, bytes);
+                        blit_line(fbp, line, w * 4);
+                        blit_line(fbp + stride, line, w * 4);
+                        fbp += 2 * stride;
+                        buf += 2 * WIDTH * bytes;
+                }
+        } else if (!strncmp(format_name, "y10", 3) || !strncmp(format_name, "y12", 3)) {
+                if (tonemap_bits != grey_bits())
+                        build_tonemap(grey_bits());
+                line = get_scratch(w * 6);
+                for (i = 0; i < h; i++) {
+                        if (!strncmp(format_name, "y10p", 4)) {
+                                y10p_to_rgb32(buf, (unsigned int *)line,
+                                              (unsigned short *)(line + w * 4), w);
+                                buf += WIDTH * 5 / 4;
+                        } else {
+                                grey16_to_rgb32((const unsigned short *)buf,
+                                                (unsigned int *)line, w);
+                                buf += WIDTH * 2;
+                        }
+                        blit_line(fbp, line, w * 4);
+                        fbp += stride;
+                }
+        } else {
+                fprintf(stderr, "format not supported to stream to Framebuffer\n");
+        }
+}
+
+struct frame32 {
+        unsigned char  *data;
+        size_t          size;
+};
+
+static struct frame32   rgb32_copy[N_DEVS_MAX];
+
+/* A cached 32 bit frame of the current size */
+static unsigned char *frame32(struct frame32 *f)
+{
+        size_t size = (size_t)WIDTH * 4 * HEIGHT;
+
+        if (size > f->size) {
+                free(f->data);
+                f->data = malloc(size);
+                if (!f->data) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                f->size = size;
+        }
+
+        return f->data;
+}
+
+/* The frame as 32 bit pixels, converted into a cached copy unless it already is */
+static const unsigned char *rgb32_frame(const unsigned char *p, int dev)
+{
+        if (!strncmp(format_name, "rgb32", 5) || !strncmp(format_name, "raw10", 5))
+                return p;
+
+        convert_frame(p, frame32(&rgb32_copy[dev]), WIDTH * 4, WIDTH, HEIGHT);
+
+        return rgb32_copy[dev].data;
+}
+
+/*
+ * Rotation and mirroring for cameras mounted turned or seen in a mirror.
+ * Turns by 90 or 270 degrees read source columns into output rows; they
+ * are done in blocks of ORIENT_BLOCK x ORIENT_BLOCK pixels into a band of
+ * cached scratch rows, so every source cache line is used whole while it
+ * is loaded, and the band then goes out with full framebuffer bursts.
+ */
+#define ORIENT_BLOCK    16
+
+struct orientation {
+        int             rotate;                 /* 0, 90, 180, 270 clockwise */
+        int             hflip, vflip;           /* after rotating */
+        int             transpose;              /* output rows are source columns */
+        int             mirror_x, mirror_y;     /* source walked backwards */
+};
+
+static struct orientation orient[N_DEVS_MAX];
+
+static inline int oriented(int dev)
+{
+        return orient[dev].rotate || orient[dev].hflip || orient[dev].vflip;
+}
+
+/* "90", "180h", "v": degrees clockwise, then h and/or v flips; @o is undefined on error */
+static int parse_orientation(const char *s, struct orientation *o)
+{
+        char *end;
+
+        CLEAR(*o);
+        o->rotate = strtol(s, &end, 10);
+        for (; *end; end++) {
+                if ('h' == *end)
+                        o->hflip = !o->hflip;
+                else if ('v' == *end)
+                        o->vflip = !o->vflip;
+                else
+                        return -1;
+        }
+        if (o->rotate % 90 || o->rotate < 0 || o->rotate > 270)
+                return -1;
+
+        /* Fold everything into a transpose and walking directions */
+        switch (o->rotate) {
+        case 0:
+                o->mirror_x = o->hflip;
+                o->mirror_y = o->vflip;
+                break;
+        case 90:
+                o->transpose = 1;
+                o->mirror_x = o->vflip;
+                o->mirror_y = !o->hflip;
                 break;
+        case 180:
+                o->mirror_x = !o->hflip;
+                o->mirror_y = !o->vflip;
+                break;
+        case 270:
+                o->transpose = 1;
+                o->mirror_x = !o->vflip;
+                o->mirror_y = o->hflip;
+                break;
+        }
+
+        return 0;
+}
+
+/* Size of the oriented picture shown in a @w x @h tile */
+static void orient_size(const struct orientation *o, int *w, int *h)
+{
+        if (o->transpose) {
+                if (*w > HEIGHT)
+                        *w = HEIGHT;
+                if (*h > WIDTH)
+                        *h = WIDTH;
+        }
+}
+
+/* 32 bit @src of @sw x @sh oriented into @w x @h of @dst */
+static void orient_frame(const unsigned char *src, long src_stride, int sw, int sh,
+                         unsigned char *dst, long dst_stride, int w, int h,
+                         const struct orientation *o)
+{
+        const unsigned int *s, *rows[ORIENT_BLOCK];
+        unsigned int *band;
+        int x, y, x0, y0, nx, ny, col;
+
+        if (!o->transpose) {
+                band = (unsigned int *)get_scratch(w * 4);
+                for (y = 0; y < h; y++) {
+                        s = (const unsigned int *)(src + (o->mirror_y ? sh - 1 - y : y) * src_stride);
+                        if (o->mirror_x) {
+                                for (x = 0; x < w; x++)
+                                        band[x] = s[sw - 1 - x];
+                                s = band;
+                        }
+                        blit_line(dst + y * dst_stride, s, w * 4);
+                }
+                return;
+        }
+
+        band = (unsigned int *)get_scratch((size_t)ORIENT_BLOCK * w * 4);
+        for (y0 = 0; y0 < h; y0 += ORIENT_BLOCK) {
+                ny = h - y0 < ORIENT_BLOCK ? h - y0 : ORIENT_BLOCK;
+
+                /* Output row y0 + y is source column x(y), output column x is source row y(x) */
+                for (x0 = 0; x0 < w; x0 += ORIENT_BLOCK) {
+                        nx = w - x0 < ORIENT_BLOCK ? w - x0 : ORIENT_BLOCK;
+                        for (x = 0; x < nx; x++)
+                                rows[x] = (const unsigned int *)(src + (o->mirror_y ? sh - 1 - x0 - x : x0 + x) *
+                                                                 src_stride) + (o->mirror_x ? sw - 1 - y0 : y0);
+                        for (y = 0; y < ny; y++) {
+                                col = o->mirror_x ? -y : y;
+                                for (x = 0; x < nx; x++)
+                                        band[y * w + x0 + x] = rows[x][col];
+                        }
+                }
+
+                for (y = 0; y < ny; y++)
+                        blit_line(dst + (y0 + y) * dst_stride, band + y * w, w * 4);
+        }
+}
+
+/*
+ * Lens distortion correction. Every output pixel of a calibrated camera's
+ * tile has a precomputed source position in 12.4 fixed point, so at run
+ * time each pixel is two table reads and a bilinear blend of four source
+ * pixels. The tile is split in bands of rows shared between a pool of
+ * threads, and each band is done in column blocks that keep the source
+ * rows it needs in the cache.
+ */
+#define REMAP_FRAC      4
+#define REMAP_NONE      0xffff          /* outside the source, black */
+#define REMAP_BAND      16              /* rows */
+#define REMAP_BLOCK     128             /* pixels */
+
+typedef unsigned char v8u8 __attribute__((vector_size(8)));
+
+enum lens_model {
+        LENS_NONE,
+        LENS_RADIAL,            /* Brown-Conrady: k1 k2 p1 p2 k3 */
+        LENS_FISHEYE,           /* equidistant: k1 k2 k3 k4 */
+};
+
+struct lens {
+        enum lens_model model;
+        double          fx, fy, cx, cy;
+        double          k[5];
+        double          scale;  /* output focal length over input */
+};
+
+struct remap_map {
+        uint16_t       *map;    /* u, v per output pixel */
+        int             width;
+        int             height;
+        int             src_width;      /* frame the positions are clamped to */
+        int             src_height;
+};
+
+struct remap_job {
+        const unsigned char *src;
+        long            src_stride;
+        unsigned char  *dst;
+        long            dst_stride;
+        const struct remap_map *m;
+};
+
+static struct lens      lens[N_DEVS_MAX];
+static struct remap_map remap[N_DEVS_MAX];
+static struct remap_job remap_job;
+static struct frame32   remap_out[N_DEVS_MAX];
+static pthread_mutex_t  remap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   remap_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   remap_idle = PTHREAD_COND_INITIALIZER;
+static unsigned int     remap_gen, remap_busy, remap_next;
+static int              remap_pool;
+
+/*
+ * Lines of "<camera> radial fx fy cx cy k1 k2 p1 p2 k3 [scale]" or
+ * "<camera> fisheye fx fy cx cy k1 k2 k3 k4 [scale]", # starts a comment.
+ */
+static void load_calibration(const char *name)
+{
+        char line[512], model[16], *s, *end;
+        double v[10];
+        int cam, n, pos, nk, ln = 0;
+        FILE *fp;
+
+        fp = fopen(name, "r");
+        if (!fp) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        while (fgets(line, sizeof(line), fp)) {
+                ln++;
+                if ((s = strchr(line, '#')))
+                        *s = '\0';
+                if (2 != sscanf(line, "%d %15s %n", &cam, model, &pos))
+                        continue;
+
+                for (n = 0, s = line + pos; n < 10; n++, s = end) {
+                        v[n] = strtod(s, &end);
+                        if (end == s)
+                                break;
+                }
+
+                nk = !strcmp(model, "radial") ? 5 : !strcmp(model, "fisheye") ? 4 : 0;
+                if (cam < 0 || cam >= N_DEVS_MAX || !nk || n < 4 + nk) {
+                        fprintf(stderr, "%s:%d: bad calibration\n", name, ln);
+                        exit(EXIT_FAILURE);
+                }
+
+                CLEAR(lens[cam]);
+                lens[cam].model = 5 == nk ? LENS_RADIAL : LENS_FISHEYE;
+                lens[cam].fx = v[0];
+                lens[cam].fy = v[1];
+                lens[cam].cx = v[2];
+                lens[cam].cy = v[3];
+                memcpy(lens[cam].k, v + 4, nk * sizeof(double));
+                lens[cam].scale = n > 4 + nk ? v[4 + nk] : 1.0;
+        }
+
+        fclose(fp);
+}
+
+/* Source position of output pixel @x, @y, false if it falls outside the frame */
+static int lens_distort(const struct lens *l, double x, double y, double *u, double *v)
+{
+        double xn = (x - l->cx) / (l->fx * l->scale);
+        double yn = (y - l->cy) / (l->fy * l->scale);
+        double r2 = xn * xn + yn * yn, xd, yd, f;
+
+        if (LENS_RADIAL == l->model) {
+                f = 1 + r2 * (l->k[0] + r2 * (l->k[1] + r2 * l->k[4]));
+                xd = xn * f + 2 * l->k[2] * xn * yn + l->k[3] * (r2 + 2 * xn * xn);
+                yd = yn * f + l->k[2] * (r2 + 2 * yn * yn) + 2 * l->k[3] * xn * yn;
+        } else {
+                double r = sqrt(r2), t = atan(r), t2 = t * t;
+
+                f = t * (1 + t2 * (l->k[0] + t2 * (l->k[1] + t2 * (l->k[2] + t2 * l->k[3]))));
+                f = r > 1e-9 ? f / r : 1;
+                xd = xn * f;
+                yd = yn * f;
+        }
+
+        *u = l->fx * xd + l->cx;
+        *v = l->fy * yd + l->cy;
+
+        if (*u < 0 || *v < 0 || *u > WIDTH - 1 || *v > HEIGHT - 1)
+                return 0;
+
+        /* Keep the right/bottom neighbour of the blend inside the frame */
+        *u = fmin(*u, WIDTH - 1 - 1.0 / (1 << REMAP_FRAC));
+        *v = fmin(*v, HEIGHT - 1 - 1.0 / (1 << REMAP_FRAC));
+
+        return 1;
+}
+
+static void build_remap(int dev, int w, int h)
+{
+        struct remap_map *m = &remap[dev];
+        struct timeval t0, t1;
+        uint16_t *p;
+        double u, v;
+        int x, y;
+
+        if (WIDTH > 4095 || HEIGHT > 4095) {
+                fprintf(stderr, "remap: frames are limited to 4095x4095\n");
+                exit(EXIT_FAILURE);
+        }
+
+        gettimeofday(&t0, NULL);
+
+        free(m->map);
+        m->map = malloc((size_t)w * h * 2 * sizeof(*m->map));
+        if (!m->map) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        m->width = w;
+        m->height = h;
+        m->src_width = WIDTH;
+        m->src_height = HEIGHT;
+
+        for (y = 0, p = m->map; y < h; y++) {
+                for (x = 0; x < w; x++, p += 2) {
+                        if (lens_distort(&lens[dev], x, y, &u, &v)) {
+                                p[0] = lrint(u * (1 << REMAP_FRAC));
+                                p[1] = lrint(v * (1 << REMAP_FRAC));
+                        } else {
+                                p[0] = p[1] = REMAP_NONE;
+                        }
+                }
+        }
+
+        gettimeofday(&t1, NULL);
+        fprintf(stderr, "%s: remap %dx%d built in %lu ms\n", dev_name[dev], w, h,
+                uSecElapsed(&t1, &t0) / 1000);
+}
+
+static inline unsigned int bilinear(const unsigned char *s, long stride, unsigned int fx, unsigned int fy)
+{
+        v8u8 r0, r1;
+        v8u16 wx = { 16 - fx, 16 - fx, 16 - fx, 16 - fx, fx, fx, fx, fx };
+        v8u16 c;
+
+        memcpy(&r0, s, 8);
+        memcpy(&r1, s + stride, 8);
+
+        /* Weights sum to 256, so every lane stays within 16 bits */
+        c = __builtin_convertvector(r0, v8u16) * wx * (unsigned short)(16 - fy) +
+            __builtin_convertvector(r1, v8u16) * wx * (unsigned short)fy;
+        c = (c + __builtin_shuffle(c, (v8u16){ 4, 5, 6, 7, 0, 1, 2, 3 }) + 128) >> 8;
+
+        return c[0] | c[1] << 8 | c[2] << 16 | c[3] << 24;
+}
+
+static void remap_band(const struct remap_job *j, int y0, int y1)
+{
+        const struct remap_map *m = j->m;
+        const uint16_t *p;
+        unsigned int *out;
+        int x0, x1, x, y;
+
+        for (x0 = 0; x0 < m->width; x0 = x1) {
+                x1 = x0 + REMAP_BLOCK < m->width ? x0 + REMAP_BLOCK : m->width;
+                for (y = y0; y < y1; y++) {
+                        p = m->map + ((size_t)y * m->width + x0) * 2;
+                        out = (unsigned int *)(j->dst + y * j->dst_stride) + x0;
+                        for (x = x0; x < x1; x++, p += 2) {
+                                if (REMAP_NONE == p[0]) {
+                                        *out++ = 0;
+                                        continue;
+                                }
+                                *out++ = bilinear(j->src + (p[1] >> REMAP_FRAC) * j->src_stride +
+                                                  (p[0] >> REMAP_FRAC) * 4, j->src_stride,
+                                                  p[0] & 15, p[1] & 15);
+                        }
+                }
+        }
+}
+
+/* Take bands until the frame is done */
+static void remap_work(const struct remap_job *j)
+{
+        unsigned int band;
+        int y;
+
+        while ((y = (band = __sync_fetch_and_add(&remap_next, 1)) * REMAP_BAND) < j->m->height)
+                remap_band(j, y, y + REMAP_BAND < j->m->height ? y + REMAP_BAND : j->m->height);
+}
+
+static void *remap_thread(void *arg)
+{
+        unsigned int gen = 0;
+
+        (void)arg;
+        unpin_thread();
+
+        pthread_mutex_lock(&remap_lock);
+        for (;;) {
+                while (gen == remap_gen)
+                        pthread_cond_wait(&remap_go, &remap_lock);
+                gen = remap_gen;
+                pthread_mutex_unlock(&remap_lock);
+
+                remap_work(&remap_job);
+
+                pthread_mutex_lock(&remap_lock);
+                if (!--remap_busy)
+                        pthread_cond_signal(&remap_idle);
+        }
+
+        return NULL;
+}
+
+/* 32 bit @src to @dst through the map of @dev, the calling thread helps */
+static void remap_frame(int dev, const unsigned char *src, long src_stride,
+                        unsigned char *dst, long dst_stride)
+{
+        remap_job.src = src;
+        remap_job.src_stride = src_stride;
+        remap_job.dst = dst;
+        remap_job.dst_stride = dst_stride;
+        remap_job.m = &remap[dev];
+        remap_next = 0;
+
+        pthread_mutex_lock(&remap_lock);
+        remap_busy = remap_pool;
+        remap_gen++;
+        pthread_cond_broadcast(&remap_go);
+        pthread_mutex_unlock(&remap_lock);
+
+        remap_work(&remap_job);
+
+        pthread_mutex_lock(&remap_lock);
+        while (remap_busy)
+                pthread_cond_wait(&remap_idle, &remap_lock);
+        pthread_mutex_unlock(&remap_lock);
+}
+
+/* The map of @dev no longer fits a @w x @h output or the current frame */
+static int remap_stale(int dev, int w, int h)
+{
+        const struct remap_map *m = &remap[dev];
+
+        return m->width != w || m->height != h ||
+               m->src_width != WIDTH || m->src_height != HEIGHT;
+}
+
+/*
+ * Correct @src straight into the tile at @fbp, or with the camera rotated
+ * into a whole cached frame that is returned for orient_frame().
+ */
+static const unsigned char *undistort(int dev, const unsigned char *src, unsigned char *fbp, int w, int h)
+{
+        if (!oriented(dev)) {
+                if (remap_stale(dev, w, h))
+                        build_remap(dev, w, h);
+                remap_frame(dev, src, WIDTH * 4, fbp, finfo.line_length);
+                return NULL;
+        }
+
+        if (remap_stale(dev, WIDTH, HEIGHT))
+                build_remap(dev, WIDTH, HEIGHT);
+        remap_frame(dev, src, WIDTH * 4, frame32(&remap_out[dev]), WIDTH * 4);
+
+        return remap_out[dev].data;
+}
+
+/* Start the helper threads, the caller is the last of remap_threads */
+static void start_remap(int threads)
+{
+        pthread_t t;
+
+        if (threads <= 0)
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (remap_pool = 0; remap_pool < threads - 1; remap_pool++)
+                if (pthread_create(&t, NULL, remap_thread, NULL)) {
+                        fprintf(stderr, "Cannot create remap thread\n");
+                        exit(EXIT_FAILURE);
+                }
+}
+
+/* Maps for every calibrated camera's tile, once the framebuffer is open */
+static void setup_remap(void)
+{
+        int dev, w, h, any = 0;
+
+        for (dev = 0; dev < n_devs; dev++) {
+                if (LENS_NONE == lens[dev].model)
+                        continue;
+                any = 1;
+                if (oriented(dev)) {
+                        build_remap(dev, WIDTH, HEIGHT);
+                } else if (out_fb) {
+                        fb_tile(dev, &w, &h);
+                        build_remap(dev, w, h);
+                }
+        }
+
+        if (any)
+                start_remap(remap_threads);
+}
+
+/*
+ * Lossless recording.
+ *
+ * Frames are copied into a small ring of slots and split into chunks that
+ * a pool of worker threads compresses in parallel with LZ4 (block format,
+ * built in), optionally after a delta predictor. A writer thread stores
+ * completed frames in order. The capture thread never waits: when the
+ * ring is full the frame is dropped and counted.
+ */
+#define REC_SLOTS       8
+#define REC_CHUNK       (256 << 10)
+#define REC_STORED      0x80000000      /* chunk kept uncompressed */
+#define LZ4_HASH_LOG    12
+#define LZ4_BOUND(n)    ((n) + (n) / 255 + 16)
+
+struct rec_header {
+        char            magic[4];       /* "CAPZ" */
+        uint32_t        version;
+        uint32_t        width;
+        uint32_t        height;
+        char            format[16];
+        uint32_t        chunk_size;
+        uint32_t        predictor;      /* sample bytes << 8 | distance in samples, 0 = none */
+};
+
+struct rec_frame_header {
+        uint32_t        dev;
+        uint32_t        seq;
+        uint32_t        size;           /* raw bytes */
+        uint32_t        chunks;         /* followed by the compressed length of each */
+};
+
+struct rec_slot {
+        unsigned char  *raw;
+        unsigned char  *out;            /* chunk i at i * LZ4_BOUND(REC_CHUNK) */
+        uint32_t       *clen;
+        size_t          alloc;
+        struct rec_frame_header hdr;
+        unsigned int    next_chunk;
+        unsigned int    done_chunks;
+};
+
+static pthread_mutex_t  rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   rec_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   rec_done = PTHREAD_COND_INITIALIZER;
+static struct rec_slot  rec_slots[REC_SLOTS];
+static unsigned int     rec_head, rec_count;
+static int              rec_stop;
+static int              rec_error;      /* write failed, frames are dropped */
+static FILE            *rec_fp;
+static pthread_t        rec_thread[64], rec_writer;
+static unsigned long long rec_in[64], rec_out[64];
+static double           rec_cpu[64];
+static unsigned int     rec_seq[N_DEVS_MAX];
+static unsigned long    rec_frames, rec_dropped;
+
+static inline uint32_t read32(const unsigned char *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, 4);
+        return v;
+}
+
+static unsigned char *lz4_len(unsigned char *op, size_t len)
+{
+        for (; len >= 255; len -= 255)
+                *op++ = 255;
+        *op++ = len;
+
+        return op;
+}
+
+static unsigned char *lz4_sequence(unsigned char *op, const unsigned char *lit,
+                                   size_t n_lit, size_t offset, size_t n_match)
+{
+        unsigned char *token = op++;
+
+        *token = (n_lit >= 15 ? 15 : n_lit) << 4;
+        if (n_lit >= 15)
+                op = lz4_len(op, n_lit - 15);
+        memcpy(op, lit, n_lit);
+        op += n_lit;
+
+        /* The last sequence has literals only */
+        if (!offset)
+                return op;
+
+        *op++ = offset;
+        *op++ = offset >> 8;
+        n_match -= 4;
+        *token |= n_match >= 15 ? 15 : n_match;
+        if (n_match >= 15)
+                op = lz4_len(op, n_match - 15);
+
+        return op;
+}
+
+/* LZ4 block of @n bytes into @dst, which holds LZ4_BOUND(n) */
+static size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst)
+{
+        uint32_t table[1 << LZ4_HASH_LOG];
+        const unsigned char *ip = src, *anchor = src, *ref, *m;
+        const unsigned char *mflimit = src + n - 12;    /* last match starts before */
+        const unsigned char *matchlimit = src + n - 5;  /* last 5 bytes are literals */
+        unsigned char *op = dst;
+        uint32_t seq, h;
+
+        memset(table, 0, sizeof(table));
+
+        if (n >= 13) {
+                while (ip < mflimit) {
+                        seq = read32(ip);
+                        h = (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+                        ref = src + table[h];
+                        table[h] = ip - src;
+
+                        if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+                                /* Skip faster through data that doesn't compress */
+                                ip += 1 + ((ip - anchor) >> 6);
+                                continue;
+                        }
+
+                        for (m = ip + 4, ref += 4; m < matchlimit && *m == *ref; m++, ref++)
+                                ;
+
+                        op = lz4_sequence(op, anchor, ip - anchor, m - ref, m - ip);
+                        ip = anchor = m;
+                }
+        }
+
+        op = lz4_sequence(op, anchor, src + n - anchor, 0, 0);
+
+        return op - dst;
+}
+
+/* Returns the decompressed size, or -1 if @src is corrupt or too big for @cap */
+static long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+        const unsigned char *ip = src, *iend = src + n;
+        unsigned char *op = dst, *oend = dst + cap;
+        const unsigned char *ref;
+        size_t len, offset;
+        unsigned char b;
+
+        while (ip < iend) {
+                unsigned char token = *ip++;
+
+                len = token >> 4;
+                if (15 == len) {
+                        do {
+                                if (ip >= iend)
+                                        return -1;
+                                b = *ip++;
+                                len += b;
+                        } while (255 == b);
+                }
+                if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+                        return -1;
+                memcpy(op, ip, len);
+                op += len;
+                ip += len;
+
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -1;
+                offset = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (!offset || offset > (size_t)(op - dst))
+                        return -1;
+
+                len = token & 15;
+                if (15 == len) {
+                        do {
+                                if (ip >= iend)
+                                        return -1;
+                                b = *ip++;
+                                len += b;
+                        } while (255 == b);
+                }
+                len += 4;
+                if (len > (size_t)(oend - op))
+                        return -1;
+
+                /* Overlapping matches repeat their own output, byte by byte */
+                ref = op - offset;
+                if (offset >= len) {
+                        memcpy(op, ref, len);
+                        op += len;
+                } else {
+                        while (len--)
+                                *op++ = *ref++;
+                }
+        }
+
+        return op - dst;
+}
+
+/*
+ * Delta predictor: every sample minus the one @dist samples back, which for
+ * Bayer is the previous sample of the same colour. 16 bit deltas are then
+ * split in a low and a high byte plane, the high plane is almost all
+ * 0x00/0xff and compresses well.
+ */
+static void predict(const unsigned char *src, unsigned char *dst, size_t n, int bytes, int dist)
+{
+        size_t i, samples = n / bytes;
+
+        if (1 == bytes) {
+                for (i = 0; i < n; i++)
+                        dst[i] = src[i] - (i >= (size_t)dist ? src[i - dist] : 0);
+                return;
+        }
+
+        for (i = 0; i < samples; i++) {
+                uint16_t s, p = 0, d;
+
+                memcpy(&s, src + 2 * i, 2);
+                if (i >= (size_t)dist)
+                        memcpy(&p, src + 2 * (i - dist), 2);
+                d = s - p;
+                dst[i] = d;
+                dst[samples + i] = d >> 8;
+        }
+        /* Odd trailing byte as is */
+        if (n & 1)
+                dst[n - 1] = src[n - 1];
+}
+
+static void unpredict(const unsigned char *src, unsigned char *dst, size_t n, int bytes, int dist)
+{
+        size_t i, samples = n / bytes;
+
+        if (1 == bytes) {
+                for (i = 0; i < n; i++)
+                        dst[i] = src[i] + (i >= (size_t)dist ? dst[i - dist] : 0);
+                return;
+        }
+
+        for (i = 0; i < samples; i++) {
+                uint16_t s, p = 0;
+
+                if (i >= (size_t)dist)
+                        memcpy(&p, dst + 2 * (i - dist), 2);
+                s = (src[i] | src[samples + i] << 8) + p;
+                memcpy(dst + 2 * i, &s, 2);
+        }
+        if (n & 1)
+                dst[n - 1] = src[n - 1];
+}
+
+/* Predictor for the current format, sample bytes << 8 | distance */
+static uint32_t rec_predictor(void)
+{
+        if (!rec_predict)
+                return 0;
+        if (!strncmp(format_name, "y10p", 4))
+                return 1 << 8 | 5;
+        if (!strncmp(format_name, "y10", 3) || !strncmp(format_name, "y12", 3) ||
+            !strncmp(format_name, "bggr12", 6))
+                return 2 << 8 | 2;
+        if (!strncmp(format_name, "bggr8", 5) || !strncmp(format_name, "grey", 4))
+                return 1 << 8 | 2;
+        /* rgb32/raw10 channels, uyvy/yuyv chroma repeat every 4 bytes */
+        return 1 << 8 | 4;
+}
+
+/* Compress one chunk of @in into @out, returns the stored length */
+static uint32_t rec_compress_chunk(const unsigned char *in, size_t n, unsigned char *out,
+                                   unsigned char *tmp, uint32_t pred)
+{
+        size_t len;
+
+        if (pred) {
+                predict(in, tmp, n, pred >> 8, pred & 0xff);
+                in = tmp;
+        }
+
+        len = lz4_compress(in, n, out);
+        if (len >= n) {
+                memcpy(out, in, n);
+                return n | REC_STORED;
+        }
+
+        return len;
+}
+
+static void *rec_worker(void *arg)
+{
+        unsigned long id = (unsigned long)arg;
+        unsigned char *tmp = malloc(REC_CHUNK);
+        uint32_t pred = rec_predictor();
+        struct timespec cpu;
+        struct rec_slot *slot;
+        unsigned int i, c;
+        size_t off, n;
+
+        if (!tmp) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&rec_lock);
+        for (;;) {
+                /* Oldest frame with chunks left */
+                slot = NULL;
+                for (i = 0; i < rec_count; i++) {
+                        slot = &rec_slots[(rec_head + i) % REC_SLOTS];
+                        if (slot->next_chunk < slot->hdr.chunks)
+                                break;
+                        slot = NULL;
+                }
+
+                if (!slot) {
+                        if (rec_stop)
+                                break;
+                        pthread_cond_wait(&rec_work, &rec_lock);
+                        continue;
+                }
+
+                c = slot->next_chunk++;
+                pthread_mutex_unlock(&rec_lock);
+
+                off = (size_t)c * REC_CHUNK;
+                n = slot->hdr.size - off < REC_CHUNK ? slot->hdr.size - off : REC_CHUNK;
+                slot->clen[c] = rec_compress_chunk(slot->raw + off, n,
+                                                   slot->out + (size_t)c * LZ4_BOUND(REC_CHUNK),
+                                                   tmp, pred);
+                rec_in[id] += n;
+                rec_out[id] += slot->clen[c] & ~REC_STORED;
+
+                pthread_mutex_lock(&rec_lock);
+                if (++slot->done_chunks == slot->hdr.chunks)
+                        pthread_cond_broadcast(&rec_done);
+        }
+        pthread_mutex_unlock(&rec_lock);
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        rec_cpu[id] = cpu.tv_sec + cpu.tv_nsec / 1e9;
+        free(tmp);
+
+        return NULL;
+}
+
+static int rec_write_frame(const struct rec_slot *slot)
+{
+        size_t len;
+        unsigned int c;
+
+        if (1 != fwrite(&slot->hdr, sizeof(slot->hdr), 1, rec_fp) ||
+            slot->hdr.chunks != fwrite(slot->clen, sizeof(*slot->clen), slot->hdr.chunks, rec_fp))
+                return -1;
+
+        for (c = 0; c < slot->hdr.chunks; c++) {
+                len = slot->clen[c] & ~REC_STORED;
+                if (len && 1 != fwrite(slot->out + (size_t)c * LZ4_BOUND(REC_CHUNK), len, 1, rec_fp))
+                        return -1;
+        }
+
+        return 0;
+}
+
+static void *rec_write(void *arg)
+{
+        struct rec_slot *slot;
+        int ret;
+
+        (void)arg;
+
+        pthread_mutex_lock(&rec_lock);
+        for (;;) {
+                if (!rec_count) {
+                        if (rec_stop)
+                                break;
+                        pthread_cond_wait(&rec_done, &rec_lock);
+                        continue;
+                }
+
+                slot = &rec_slots[rec_head];
+                if (slot->done_chunks < slot->hdr.chunks) {
+                        pthread_cond_wait(&rec_done, &rec_lock);
+                        continue;
+                }
+                pthread_mutex_unlock(&rec_lock);
+
+                /* Frames go out in capture order, after an error they are only dropped */
+                ret = rec_error ? -1 : rec_write_frame(slot);
+                if (-1 == ret && !rec_error)
+                        fprintf(stderr, "Cannot write '%s': %d, %s, recording stopped\n",
+                                rec_name, errno, strerror(errno));
+
+                pthread_mutex_lock(&rec_lock);
+                if (-1 == ret) {
+                        rec_error = 1;
+                        rec_frames--;
+                        rec_dropped++;
+                }
+                rec_head = (rec_head + 1) % REC_SLOTS;
+                rec_count--;
+        }
+        pthread_mutex_unlock(&rec_lock);
+
+        return NULL;
+}
+
+static void record_frame(const void *p, size_t size, int dev)
+{
+        struct rec_slot *slot;
+        unsigned int chunks = (size + REC_CHUNK - 1) / REC_CHUNK;
+
+        pthread_mutex_lock(&rec_lock);
+        if (REC_SLOTS == rec_count || rec_error) {
+                rec_dropped++;
+                pthread_mutex_unlock(&rec_lock);
+                return;
+        }
+        slot = &rec_slots[(rec_head + rec_count) % REC_SLOTS];
+        pthread_mutex_unlock(&rec_lock);
+
+        /* The slot is ours until it is queued */
+        if (size > slot->alloc) {
+                free(slot->raw);
+                free(slot->out);
+                free(slot->clen);
+                slot->raw = malloc(size);
+                slot->out = malloc((size_t)chunks * LZ4_BOUND(REC_CHUNK));
+                slot->clen = malloc(chunks * sizeof(*slot->clen));
+                if (!slot->raw || !slot->out || !slot->clen) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                slot->alloc = size;
+        }
+
+        memcpy(slot->raw, p, size);
+        slot->hdr.dev = dev;
+        slot->hdr.seq = rec_seq[dev]++;
+        slot->hdr.size = size;
+        slot->hdr.chunks = chunks;
+        slot->next_chunk = 0;
+        slot->done_chunks = 0;
+
+        pthread_mutex_lock(&rec_lock);
+        rec_count++;
+        rec_frames++;
+        pthread_cond_broadcast(&rec_work);
+        pthread_mutex_unlock(&rec_lock);
+}
+
+static void start_recording(void)
+{
+        struct rec_header hdr;
+        unsigned long i;
+
+        if (!rec_name)
+                return;
+
+        rec_fp = fopen(rec_name, "wb");
+        if (!rec_fp) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                         rec_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        CLEAR(hdr);
+        memcpy(hdr.magic, "CAPZ", 4);
+        hdr.version = 1;
+        hdr.width = WIDTH;
+        hdr.height = HEIGHT;
+        strncpy(hdr.format, format_name, sizeof(hdr.format) - 1);
+        hdr.chunk_size = REC_CHUNK;
+        hdr.predictor = rec_predictor();
+        if (1 != fwrite(&hdr, sizeof(hdr), 1, rec_fp)) {
+                fprintf(stderr, "Cannot write '%s': %d, %s\n",
+                         rec_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (rec_workers <= 0)
+                rec_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (rec_workers > 64)
+                rec_workers = 64;
+
+        for (i = 0; i < (unsigned long)rec_workers; i++)
+                if (pthread_create(&rec_thread[i], NULL, rec_worker, (void *)i)) {
+                        fprintf(stderr, "Cannot create compression thread\n");
+                        exit(EXIT_FAILURE);
+                }
+        if (pthread_create(&rec_writer, NULL, rec_write, NULL)) {
+                fprintf(stderr, "Cannot create writer thread\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void stop_recording(void)
+{
+        unsigned long long in = 0, out = 0;
+        double cpu = 0;
+        int i;
+
+        if (!rec_fp)
+                return;
+
+        pthread_mutex_lock(&rec_lock);
+        rec_stop = 1;
+        pthread_cond_broadcast(&rec_work);
+        pthread_cond_broadcast(&rec_done);
+        pthread_mutex_unlock(&rec_lock);
+
+        for (i = 0; i < rec_workers; i++) {
+                pthread_join(rec_thread[i], NULL);
+                in += rec_in[i];
+                out += rec_out[i];
+                cpu += rec_cpu[i];
+        }
+        /* Workers are done, wake the writer for the last frames */
+        pthread_mutex_lock(&rec_lock);
+        pthread_cond_broadcast(&rec_done);
+        pthread_mutex_unlock(&rec_lock);
+        pthread_join(rec_writer, NULL);
+
+        /* Buffered frames only reach the file here */
+        if (fclose(rec_fp) && !rec_error) {
+                fprintf(stderr, "Cannot write '%s': %d, %s\n",
+                         rec_name, errno, strerror(errno));
+                rec_error = 1;
+        }
+        rec_fp = NULL;
+
+        fprintf(stderr, "recorded %lu frames, %lu dropped, ratio %.2f, %.1f MB/s per core on %d workers%s\n",
+                rec_frames, rec_dropped, out ? (double)in / out : 0,
+                cpu > 0 ? in / cpu / 1e6 : 0, rec_workers,
+                rec_error ? ", recording incomplete" : "");
+}
+
+/*
+ * Rate control per device and output. An output takes every n-th frame,
+ * or frames paced to a target rate on the driver's buffer timestamps;
+ * frames it doesn't take cost nothing there, the buffer still goes
+ * straight back to the driver.
+ */
+enum output {
+        OUT_BUF,
+        OUT_FB,
+        OUT_REC,
+        OUT_PYR,
+        N_OUTPUTS,
+};
+
+struct rate {
+        unsigned int    every;          /* take every n-th frame */
+        unsigned int    fps;            /* or this many per second */
+        unsigned int    n;
+        unsigned long long next;        /* us, next frame due */
+        unsigned long long last;        /* us, previous frame */
+        unsigned long   taken, skipped;
+};
+
+static const char      *output_name[N_OUTPUTS] = {"buf", "fb", "rec", "pyr"};
+static struct rate      rate[N_DEVS_MAX][N_OUTPUTS];
+static int              rate_set;
+
+/*
+ * "fb/3", "rec@10" or "2:fb@5" (device 2 only), comma separated. Nothing
+ * changes unless the whole spec is valid, and the counters carry on.
+ */
+static int parse_rates(char *spec)
+{
+        struct {
+                unsigned int every, fps;
+                int set;
+        } want[N_DEVS_MAX][N_OUTPUTS];
+        char name[8], how, *s, *save;
+        unsigned int val;
+        int dev, out, d, pos;
+
+        memset(want, 0, sizeof(want));
+
+        for (s = strtok_r(spec, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+                dev = -1;
+                pos = 0;
+                if (1 == sscanf(s, "%d:%n", &d, &pos) && pos > 0) {
+                        if (d < 0 || d >= N_DEVS_MAX)
+                                return -1;
+                        dev = d;
+                        s += pos;
+                }
+                pos = 0;
+                if (3 != sscanf(s, "%7[a-z]%c%u%n", name, &how, &val, &pos) || !pos || s[pos] ||
+                    !val || ('/' != how && '@' != how))
+                        return -1;
+                /* %u would take a sign or blanks too */
+                if (s[strlen(name) + 1] < '0' || s[strlen(name) + 1] > '9')
+                        return -1;
+
+                for (out = 0; out < N_OUTPUTS; out++)
+                        if (!strcmp(name, output_name[out]))
+                                break;
+                if (N_OUTPUTS == out)
+                        return -1;
+
+                for (d = 0; d < N_DEVS_MAX; d++) {
+                        if (dev >= 0 && d != dev)
+                                continue;
+                        want[d][out].every = '/' == how ? val : 0;
+                        want[d][out].fps = '@' == how ? val : 0;
+                        want[d][out].set = 1;
+                }
+        }
+
+        for (d = 0; d < N_DEVS_MAX; d++) {
+                for (out = 0; out < N_OUTPUTS; out++) {
+                        if (!want[d][out].set)
+                                continue;
+                        rate[d][out].every = want[d][out].every;
+                        rate[d][out].fps = want[d][out].fps;
+                        rate[d][out].n = 0;
+                        rate[d][out].next = 0;
+                        rate_set = 1;
+                }
+        }
+
+        return 0;
+}
+
+/* Whether @out of @dev takes the frame captured at @ts */
+static int take_frame(int dev, enum output out, const struct timeval *ts)
+{
+        struct rate *r = &rate[dev][out];
+        unsigned long long us, half, period;
+        int take = 1;
+
+        if (r->every) {
+                take = !(r->n++ % r->every);
+        } else if (r->fps) {
+                us = ts->tv_sec * 1000000ULL + ts->tv_usec;
+                period = 1000000 / r->fps;
+
+                /* Half a capture interval early is on time, timestamps jitter */
+                half = r->last && us > r->last ? (us - r->last) / 2 : 0;
+                r->last = us;
+
+                take = us + half >= r->next;
+                if (take)
+                        r->next = r->next + period > us ? r->next + period : us + period;
+        }
+
+        if (take)
+                r->taken++;
+        else
+                r->skipped++;
+
+        return take;
+}
+
+static void print_rates(void)
+{
+        int dev, out;
+
+        if (!rate_set)
+                return;
+
+        fprintf(stderr, "frames taken/skipped per output:\n");
+        for (dev = 0; dev < n_devs; dev++) {
+                fprintf(stderr, "%-12s", dev_name[dev]);
+                for (out = 0; out < N_OUTPUTS; out++)
+                        if (rate[dev][out].taken || rate[dev][out].skipped)
+                                fprintf(stderr, " %s %lu/%lu", output_name[out],
+                                        rate[dev][out].taken, rate[dev][out].skipped);
+                fprintf(stderr, "\n");
+        }
+}
+
+static void process_image(const void *p, int size, int dev, const struct timeval *ts)
+{
+        int to_buf, to_pyr, level;
+
+        TRACE_BEGIN(TRACE_PROCESS, dev);
+
+        to_buf = out_buf && take_frame(dev, OUT_BUF, ts);
+        to_pyr = pyramid_levels && take_frame(dev, OUT_PYR, ts);
+        level = to_buf && pyramid_out >= 0 && pyramid_out < pyramid_levels && get_pyramid_format();
+
+        /* Pyramid first, so every output can use it */
+        if (to_pyr || level)
+                build_pyramid(p, dev);
+
+        if (rec_fp && take_frame(dev, OUT_REC, ts))
+                record_frame(p, size, dev);
+
+        if (to_buf) {
+                if (level)
+                        fwrite(pyramid[dev][pyramid_out].data,
+                               (size_t)pyramid[dev][pyramid_out].stride * pyramid[dev][pyramid_out].height,
+                               1, stdout);
+                else
+                        fwrite(p, size, 1, stdout);
+        }
+
+        if (out_fb && take_frame(dev, OUT_FB, ts)) {
+                unsigned char *fbp;
+                int w, h;
+
+                TRACE_BEGIN(TRACE_FB, dev);
+                fbp = fb_tile(dev, &w, &h);
+
+                if (LENS_NONE != lens[dev].model || oriented(dev)) {
+                        const unsigned char *src = rgb32_frame(p, dev);
+
+                        if (LENS_NONE != lens[dev].model)
+                                src = undistort(dev, src, fbp, w, h);
+                        if (oriented(dev)) {
+                                orient_size(&orient[dev], &w, &h);
+                                orient_frame(src, WIDTH * 4, WIDTH, HEIGHT,
+                                             fbp, finfo.line_length, w, h, &orient[dev]);
+                        }
+                } else {
+                        convert_frame(p, fbp, finfo.line_length, w, h);
+                }
+                blit_flush();
+                TRACE_END(TRACE_FB, dev);
+        }
+
+        TRACE_END(TRACE_PROCESS, dev);
+}
+
+static int read_frame(int dev)
+{
+        struct v4l2_buffer buf;
+        struct timeval ts;
+        unsigned int i;
+        ssize_t r;
+        static unsigned int injected;
+
+        if (dev == inject_dev && !(++injected % inject_period)) {
+                errno = EIO;
+                return errno_fail(dev, "injected");
+        }
+
+        switch (io) {
+        case IO_METHOD_READ:
+                TRACE_BEGIN(TRACE_DQBUF, dev);
+                r = read(fd[dev], (buffers[dev])[0].start, (buffers[dev])[0].length);
+                trace_seq[dev]++;
+                TRACE_END(TRACE_DQBUF, dev);
+                if (-1 == r) {
+                        switch (errno) {
+                        case EAGAIN:
+                                return 0;
+                        case EIO:
+                                /* Could ignore EIO, see spec. */
+                                /* fall through */
+                        default:
+                                return errno_fail(dev, "read");
+                        }
+                }
+
+                record_dequeue(dev);
+                monotonic_timeval(&ts);
+
+                process_image((buffers[dev])[0].start, (buffers[dev])[0].length, dev, &ts);
+                break;
+
+        case IO_METHOD_MMAP:
+                CLEAR(buf);
+
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_MMAP;
+
+                TRACE_BEGIN(TRACE_DQBUF, dev);
+                r = xioctl(fd[dev], VIDIOC_DQBUF, &buf);
+                if (-1 != r)
+                        trace_seq[dev] = buf.sequence;
+                TRACE_END(TRACE_DQBUF, dev);
+                if (-1 == r) {
+                        switch (errno) {
+                        case EAGAIN:
+                                return 0;
+                        case EIO:
+                                /* Could ignore EIO, see spec. */
+                                /* fall through */
+                        default:
+                                return errno_fail(dev, "VIDIOC_DQBUF");
+                        }
+                }
+
+                record_dequeue(dev);
+
+                assert(buf.index < n_buffers[dev]);
+
+                process_image((buffers[dev])[buf.index].start, buf.bytesused, dev, &buf.timestamp);
+
+                TRACE_BEGIN(TRACE_QBUF, dev);
+                r = xioctl(fd[dev], VIDIOC_QBUF, &buf);
+                TRACE_END(TRACE_QBUF, dev);
+                if (-1 == r)
+                        return errno_fail(dev, "VIDIOC_QBUF");
+                break;
+
+        case IO_METHOD_USERPTR:
+                CLEAR(buf);
+
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_USERPTR;
+
+                TRACE_BEGIN(TRACE_DQBUF, dev);
+                r = xioctl(fd[dev], VIDIOC_DQBUF, &buf);
+                if (-1 != r)
+                        trace_seq[dev] = buf.sequence;
+                TRACE_END(TRACE_DQBUF, dev);
+                if (-1 == r) {
+                        switch (errno) {
+                        case EAGAIN:
+                                return 0;
+                        case EIO:
+                                /* Could ignore EIO, see spec. */
+                                /* fall through */
+                        default:
+                                return errno_fail(dev, "VIDIOC_DQBUF");
+                        }
+                }
+
+                record_dequeue(dev);
+
+                for (i = 0; i < n_buffers[dev]; ++i)
+                        if (buf.m.userptr == (unsigned long)(buffers[dev])[i].start
+                            && buf.length == (buffers[dev])[i].length)
+                                break;
+
+                assert(i < n_buffers[dev]);
+
+                process_image((void *)buf.m.userptr, buf.bytesused, dev, &buf.timestamp);
+
+                TRACE_BEGIN(TRACE_QBUF, dev);
+                r = xioctl(fd[dev], VIDIOC_QBUF, &buf);
+                TRACE_END(TRACE_QBUF, dev);
+                if (-1 == r)
+                        return errno_fail(dev, "VIDIOC_QBUF");
+                break;
+        }
+
+        gettimeofday(&last_frame[dev], NULL);
+        if (timerisset(&outage_start[dev])) {
+                unsigned long usec = uSecElapsed(&last_frame[dev], &outage_start[dev]);
+
+                fprintf(stderr, "%s: recovered after %lu ms\n", dev_name[dev], usec / 1000);
+                outage_usec[dev] += usec;
+                timerclear(&outage_start[dev]);
+        }
+
+        if (!timeline[dev][PHASE_FIRST_FRAME].tv_sec) {
+                gettimeofday(&timeline[dev][PHASE_FIRST_FRAME], NULL);
+                if (++first_frames == n_devs && show_timeline)
+                        print_timeline();
+        }
+
+        if (reconf_pending[dev]) {
+                struct timeval t;
+
+                gettimeofday(&t, NULL);
+                fprintf(stderr, "%s: first frame %lu us after reconfiguration\n",
+                        dev_name[dev], uSecElapsed(&t, &reconf_time[dev]));
+                reconf_pending[dev] = 0;
+        }
+
+        if (fps_count)
+                fpsCount(dev);
+
+        return 1;
+}
+
+#define max(a,b) (a>b?a:b)
+
+static void mainloop(void)
+{
+        unsigned int count = frame_count;
+        int dev = 0;
+        fd_set fds;
+        struct timeval tv;
+        int r, ret, fd_max, active, pending, down, lost;
+
+        /* Give time to queue buffers at start streaming by VIN module */
+//        usleep(34000*3);
+
+        while (daemon_mode ? !quit : count-- > 0) {
+                for (;;) {
+                        /* Stalled devices time out on their own, the others keep going */
+                        check_devices();
+
+                        FD_ZERO(&fds);
+                        fd_max = -1;
+                        active = 0;
+                        pending = 0;
+                        down = 0;
+                        lost = 0;
+
+                        for (dev = 0; dev < n_devs; dev++) {
+                                /* still being brought up by its own thread */
+                                if (starting[dev]) {
+                                        pending++;
+                                        continue;
+                                }
+                                if (given_up[dev]) {
+                                        lost++;
+                                        continue;
+                                }
+                                if (failed[dev])
+                                        down++;
+                                if (!streaming[dev])
+                                        continue;
+                                FD_SET(fd[dev], &fds);
+                                fd_max = max(fd_max, fd[dev]);
+                                active++;
+                        }
+                        if (lost == n_devs) {
+                                fprintf(stderr, "All devices lost\n");
+                                return;
+                        }
+                        /* Commands may restart devices, wait for bring-up to finish */
+                        if (-1 != cmd_fd && !pending) {
+                                FD_SET(cmd_fd, &fds);
+                                fd_max = max(fd_max, cmd_fd);
+                        }
+                        if (-1 != start_pipe[0]) {
+                                FD_SET(start_pipe[0], &fds);
+                                fd_max = max(fd_max, start_pipe[0]);
+                        }
+                        /* Timeout. */
+                        tv.tv_sec = timeout;
+                        tv.tv_usec = 0;
+                        next_retry(&tv);
+
+                        /* With every stream stopped only a command can wake us up */
+                        TRACE_BEGIN(TRACE_SELECT, -1);
+                        r = select(fd_max + 1, &fds, NULL, NULL, (active || down) ? &tv : NULL);
+                        TRACE_END(TRACE_SELECT, -1);
+                        if (-1 == r) {
+                                if (EINTR == errno)
+                                        continue;
+                                errno_exit("select");
+                        }
+
+                        if (0 == r)
+                                continue;
+
+                        if (-1 != start_pipe[0] && FD_ISSET(start_pipe[0], &fds)) {
+                                unsigned char started;
+
+                                /* A device finished its bring-up, start polling it */
+                                if (1 == read(start_pipe[0], &started, 1)) {
+                                        starting[started] = 0;
+                                        if (retrying[started])
+                                                restart_done(started);
+                                }
+                                continue;
+                        }
+
+                        if (-1 != cmd_fd && FD_ISSET(cmd_fd, &fds)) {
+                                handle_commands();
+                                if (quit)
+                                        return;
+                                /* Devices may have been restarted, fds are stale */
+                                continue;
+                        }
+
+                        r = 0;
+                        for (dev = 0; dev < n_devs; dev++) {
+                                if (!starting[dev] && streaming[dev] && FD_ISSET(fd[dev], &fds)) {
+                                        ret = read_frame(dev);
+                                        if (-1 == ret)
+                                                device_failed(dev, "capture error");
+                                        else
+                                                r += ret;
+                                }
+//                                        usleep(30000);
+                        }
+                        if (r)
+                                break;
+                        /* EAGAIN - continue select loop. */
+                }
+        }
+}
+
+static int stop_capturing(int dev)
+{
+        enum v4l2_buf_type type;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                /* Nothing to do. */
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_USERPTR:
+                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                if (-1 == xioctl(fd[dev], VIDIOC_STREAMOFF, &type))
+                        return errno_fail(dev, "VIDIOC_STREAMOFF");
+                break;
+        }
+
+        streaming[dev] = 0;
+
+        return 0;
+}
+
+static int start_capturing(int dev)
+{
+        unsigned int i;
+        enum v4l2_buf_type type;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                /* Nothing to do. */
+                break;
+
+        case IO_METHOD_MMAP:
+                for (i = 0; i < n_buffers[dev]; ++i) {
+                        struct v4l2_buffer buf;
+
+                        CLEAR(buf);
+                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                        buf.memory = V4L2_MEMORY_MMAP;
+                        buf.index = i;
+
+                        if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
+                                return errno_fail(dev, "VIDIOC_QBUF");
+                }
+                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                if (-1 == xioctl(fd[dev], VIDIOC_STREAMON, &type))
+                        return errno_fail(dev, "VIDIOC_STREAMON");
+                break;
+
+        case IO_METHOD_USERPTR:
+                for (i = 0; i < n_buffers[dev]; ++i) {
+                        struct v4l2_buffer buf;
+
+                        CLEAR(buf);
+                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                        buf.memory = V4L2_MEMORY_USERPTR;
+                        buf.index = i;
+                        buf.m.userptr = (unsigned long)(buffers[dev])[i].start;
+                        buf.length = (buffers[dev])[i].length;
+
+                        if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
+                                return errno_fail(dev, "VIDIOC_QBUF");
+                }
+                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                if (-1 == xioctl(fd[dev], VIDIOC_STREAMON, &type))
+                        return errno_fail(dev, "VIDIOC_STREAMON");
+                break;
+        }
+
+        streaming[dev] = 1;
+        gettimeofday(&last_frame[dev], NULL);
+        /* Don't count a restart as a dequeue interval */
+        dq_time[dev].tv_sec = 0;
+
+        return 0;
+}
+
+static void uninit_device(int dev)
+{
+        unsigned int i;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                free((buffers[dev])[0].start);
+                break;
+
+        case IO_METHOD_MMAP:
+                for (i = 0; i < n_buffers[dev]; ++i)
+                        if (-1 == munmap((buffers[dev])[i].start, (buffers[dev])[i].length))
+                                errno_exit("munmap");
+                break;
+
+        case IO_METHOD_USERPTR:
+                for (i = 0; i < n_buffers[dev]; ++i)
+                        free((buffers[dev])[i].start);
+                break;
+        }
+
+        free(buffers[dev]);
+        buffers[dev] = NULL;
+        n_buffers[dev] = 0;
+}
+
+static void init_read(unsigned int buffer_size, int dev)
+{
+        buffers[dev] = calloc(1, sizeof(*buffers[dev]));
+
+        if (!buffers[dev]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        (buffers[dev])[0].length = buffer_size;
+        (buffers[dev])[0].start = malloc(sizeof(unsigned char) * buffer_size);
+
+        if (!(buffers[dev])[0].start) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static int init_mmap(int dev)
+{
+        struct v4l2_requestbuffers req;
+
+        CLEAR(req);
+
+        req.count = 7;
+        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = V4L2_MEMORY_MMAP;
+
+        if (-1 == xioctl(fd[dev], VIDIOC_REQBUFS, &req)) {
+                if (EINVAL == errno) {
+                        fprintf(stderr, "%s does not support "
+                                 "memory mapping\n", dev_name[dev]);
+                        return -1;
+                } else {
+                        return errno_fail(dev, "VIDIOC_REQBUFS");
+                }
+        }
+
+        if (req.count < 2) {
+                fprintf(stderr, "Insufficient buffer memory on %s\n",
+                         dev_name[dev]);
+                return -1;
+        }
+
+        buffers[dev] = calloc(req.count, sizeof(*buffers[dev]));
+
+        if (!buffers[dev]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (n_buffers[dev] = 0; n_buffers[dev] < req.count; ++n_buffers[dev]) {
+                struct v4l2_buffer buf;
+
+                CLEAR(buf);
+
+                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory      = V4L2_MEMORY_MMAP;
+                buf.index       = n_buffers[dev];
+
+                if (-1 == xioctl(fd[dev], VIDIOC_QUERYBUF, &buf))
+                        return errno_fail(dev, "VIDIOC_QUERYBUF");
+
+                (buffers[dev])[n_buffers[dev]].length = buf.length;
+                (buffers[dev])[n_buffers[dev]].start =
+                        mmap(NULL /* start anywhere */,
+                              buf.length,
+                              PROT_READ | PROT_WRITE /* required */,
+                              MAP_SHARED /* recommended */,
+                              fd[dev], buf.m.offset);
+
+                if (MAP_FAILED == (buffers[dev])[n_buffers[dev]].start)
+                        return errno_fail(dev, "mmap");
+        }
+
+        return 0;
+}
+
+static int init_userp(unsigned int buffer_size, int dev)
+{
+        struct v4l2_requestbuffers req;
+
+        CLEAR(req);
+
+        req.count  = 4;
+        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = V4L2_MEMORY_USERPTR;
+
+        if (-1 == xioctl(fd[dev], VIDIOC_REQBUFS, &req)) {
+                if (EINVAL == errno) {
+                        fprintf(stderr, "%s does not support "
+                                 "user pointer i/o\n", dev_name[dev]);
+                        return -1;
+                } else {
+                        return errno_fail(dev, "VIDIOC_REQBUFS");
+                }
+        }
+
+        buffers[dev] = calloc(4, sizeof(*buffers[dev]));
+
+        if (!buffers[dev]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (n_buffers[dev] = 0; n_buffers[dev] < 4; ++n_buffers[dev]) {
+                (buffers[dev])[n_buffers[dev]].length = buffer_size;
+                (buffers[dev])[n_buffers[dev]].start = malloc(buffer_size);
+
+                if (!(buffers[dev])[n_buffers[dev]].start) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        return 0;
+}
+
+static int set_parm(int dev)
+{
+        struct v4l2_cropcap cropcap;
+        struct v4l2_crop crop;
+
+        /* Select video input, video standard and tune here. */
+        CLEAR(cropcap);
+        cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (0 == xioctl(fd[dev], VIDIOC_CROPCAP, &cropcap)) {
+                crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                crop.c = cropcap.defrect; /* reset to default */
+
+                crop.c.left = LEFT;
+                crop.c.top = TOP;
+                crop.c.width = WIDTH;
+                crop.c.height = HEIGHT;
+
+                if (-1 == xioctl(fd[dev], VIDIOC_S_CROP, &crop)) {
+                        switch (errno) {
+                        case EINVAL:
+                                /* Cropping not supported. */
+                                break;
+                        default:
+                                /* Errors ignored. */
+                                break;
+                        }
+                }
+        } else {
+                /* Errors ignored. */
+        }
+
+        if (framerate) {
+            struct v4l2_streamparm parm;
+
+            parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (-1 == xioctl(fd[dev], VIDIOC_G_PARM, &parm))
+                return errno_fail(dev, "VIDIOC_G_PARM");
+
+            parm.parm.capture.timeperframe.numerator = 1;
+            parm.parm.capture.timeperframe.denominator = framerate;
+            if (-1 == xioctl(fd[dev], VIDIOC_S_PARM, &parm))
+                return errno_fail(dev, "VIDIOC_S_PARM");
+        }
+
+#if 0
+    struct v4l2_control control;
+
+    memset(&control, 0, sizeof (control));
+    control.id = V4L2_CID_BRIGHTNESS;
+//    control.id = V4L2_CID_VFLIP;
+//    control.id = V4L2_CID_CONTRAST;
+//    control.id = V4L2_CID_SATURATION;
+//    control.id = V4L2_CID_GAMMA;
+//    control.id = V4L2_CID_GAIN;
+//    control.id = V4L2_CID_EXPOSURE;
+//    control.id = V4L2_CID_AUTOGAIN;
+
+    if (-1 == xioctl(fd[dev], VIDIOC_G_CTRL, &control))
+        return errno_fail(dev, "VIDIOC_G_CTRL");
+
+    control.value = 0xf0;
+
+    if (-1 == ioctl(fd[dev], VIDIOC_S_CTRL, &control))
+        return errno_fail(dev, "VIDIOC_S_CTRL");
+#endif
+
+        return 0;
+}
+
+static int get_format(int dev, struct v4l2_format *f)
+{
+        struct v4l2_format fmt;
+
+        CLEAR(fmt);
+
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width  = WIDTH;
+        fmt.fmt.pix.height = HEIGHT;
+        fmt.fmt.pix.field  = FIELD;
+
+        if (!strncmp(format_name, "uyvy", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;
+        else if (!strncmp(format_name, "yuyv", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        else if (!strncmp(format_name, "rgb565", 6))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565;
+        else if (!strncmp(format_name, "rgb32", 5))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_XBGR32;
+        else if (!strncmp(format_name, "raw10", 5))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_Y10;
+        else if (!strncmp(format_name, "y10p", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_Y10P;
+        else if (!strncmp(format_name, "y10", 3))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_Y10;
+        else if (!strncmp(format_name, "y12", 3))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_Y12;
+        else if (!strncmp(format_name, "nv12", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+        else if (!strncmp(format_name, "nv16", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV16;
+        else if (!strncmp(format_name, "bggr8", 5))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SBGGR8;
+        else if (!strncmp(format_name, "bggr12", 6))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SBGGR12;
+        else if (!strncmp(format_name, "grey", 4))
+                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
+        else {
+                /* Preserve original settings as set by v4l2-ctl for example */
+                if (-1 == xioctl(fd[dev], VIDIOC_G_FMT, &fmt))
+                        return errno_fail(dev, "VIDIOC_G_FMT");
+        }
+
+        *f = fmt;
+
+        return 0;
+}
+
+static int set_format(int dev, struct v4l2_format *fmt)
+{
+        pix_req[dev] = fmt->fmt.pix;
+
+        if (-1 == xioctl(fd[dev], VIDIOC_S_FMT, fmt))
+                return -1;
+
+        pix[dev] = fmt->fmt.pix;
+        return 0;
+}
+
+static int init_buffers(unsigned int buffer_size, int dev)
+{
+        switch (io) {
+        case IO_METHOD_READ:
+                init_read(buffer_size, dev);
+                break;
+
+        case IO_METHOD_MMAP:
+                return init_mmap(dev);
+
+        case IO_METHOD_USERPTR:
+                return init_userp(buffer_size, dev);
+        }
+
+        return 0;
+}
+
+static int free_buffers(int dev)
+{
+        struct v4l2_requestbuffers req;
+
+        uninit_device(dev);
+        if (IO_METHOD_READ == io)
+                return 0;
+
+        /* Release driver side buffers so the format may be changed */
+        CLEAR(req);
+        req.count  = 0;
+        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = (IO_METHOD_MMAP == io) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
+        if (-1 == xioctl(fd[dev], VIDIOC_REQBUFS, &req))
+                return errno_fail(dev, "VIDIOC_REQBUFS");
+
+        return 0;
+}
+
+static int init_device(int dev)
+{
+        struct v4l2_capability cap;
+        struct v4l2_format fmt;
+
+        if (-1 == xioctl(fd[dev], VIDIOC_QUERYCAP, &cap)) {
+                if (EINVAL == errno) {
+                        fprintf(stderr, "%s is no V4L2 device\n",
+                                 dev_name[dev]);
+                        return -1;
+                } else {
+                        return errno_fail(dev, "VIDIOC_QUERYCAP");
+                }
+        }
+
+        if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+                fprintf(stderr, "%s is no video capture device\n",
+                         dev_name[dev]);
+                return -1;
+        }
+
+        switch (io) {
+        case IO_METHOD_READ:
+                if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
+                        fprintf(stderr, "%s does not support read i/o\n",
+                                 dev_name[dev]);
+                        return -1;
+                }
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_USERPTR:
+                if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+                        fprintf(stderr, "%s does not support streaming i/o\n",
+                                 dev_name[dev]);
+                        return -1;
+                }
+                break;
+        }
+
+        if (-1 == set_parm(dev) || -1 == get_format(dev, &fmt))
+                return -1;
+
+        if (-1 == set_format(dev, &fmt))
+                return errno_fail(dev, "VIDIOC_S_FMT");
+
+//        printf("fmt.fmt.pix.bytesperline =%d\n\n\n",fmt.fmt.pix.bytesperline);
+
+        if (-1 == init_buffers(fmt.fmt.pix.sizeimage, dev))
+                return -1;
+
+        if (rt_prio)
+                prefault_device(dev);
+
+        return 0;
+}
+
+static void close_device(int dev)
+{
+        if (-1 == close(fd[dev]))
+                errno_exit("close");
+
+        fd[dev] = -1;
+}
+
+static int open_device(int dev)
+{
+        struct stat st;
+
+        if (-1 == stat(dev_name[dev], &st)) {
+                fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+                         dev_name[dev], errno, strerror(errno));
+                return -1;
+        }
+
+        if (!S_ISCHR(st.st_mode)) {
+                fprintf(stderr, "%s is no device\n", dev_name[dev]);
+                return -1;
+        }
+
+        fd[dev] = open(dev_name[dev], O_RDWR /* required */ | O_NONBLOCK, 0);
+
+        if (-1 == fd[dev]) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                         dev_name[dev], errno, strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static void open_fb(void)
+{
+        if (out_fb) {
+                fbfd = open(fbdev_name, O_RDWR, 0);
+                if (-1 == fbfd) {
+                        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                                 fbdev_name, errno, strerror(errno));
+                        exit(EXIT_FAILURE);
+                }
+
+                // Get fixed screen information
+                if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) == -1) {
+                        perror("Error reading fixed information");
+                        exit(EXIT_FAILURE);
+                }
+                // Get variable screen information
+                if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
+                        perror("Error reading variable information");
+                        exit(EXIT_FAILURE);
+                }
+//                printf("%dx%d, %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+
+                printf("fb0 Fixed Info:\n"
+                                "   %s  @ 0x%lx, len=%d, line=%d bytes,\n",
+                        finfo.id,
+                        finfo.smem_start,
+                        finfo.smem_len,
+                        finfo.line_length);
+
+                printf("   Geometry - %u x %u, %u bpp%s\n",
+                        vinfo.xres,
+                        vinfo.yres,
+                        vinfo.bits_per_pixel,
+                        vinfo.grayscale ? ", greyscale" : "");
+
+
+                // Figure out the size of the screen in bytes
+                screensize = finfo.smem_len; //vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
+
+                // Map the device to memory
+                fbmem = (char *)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+                if (!fbmem) {
+                        perror("Error: failed to map framebuffer device to memory");
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+static void close_fb(void)
+{
+        if (out_fb) {
+                munmap(fbmem, screensize);
+                close(fbfd);
+                fbfd = -1;
+        }
+}
+
+/*
+ * Per-device error handling: a device that fails is torn down on its own
+ * while the others keep streaming, and is restarted with exponential back-off.
+ */
+#define RETRY_DELAY_MIN 100     /* ms */
+#define RETRY_DELAY_MAX 10000   /* ms */
+#define RETRY_MAX       10      /* restarts per outage, unless in daemon mode */
+
+static void teardown_device(int dev)
+{
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        /* Errors ignored, the device is going away anyway */
+        if (streaming[dev] && IO_METHOD_READ != io)
+                xioctl(fd[dev], VIDIOC_STREAMOFF, &type);
+        streaming[dev] = 0;
+
+        if (buffers[dev])
+                uninit_device(dev);
+
+        if (-1 != fd[dev]) {
+                close(fd[dev]);
+                fd[dev] = -1;
+        }
+}
+
+static void device_failed(int dev, const char *what)
+{
+        struct timeval delay;
+
+        teardown_device(dev);
+
+        if (!timerisset(&outage_start[dev])) {
+                /* New outage, not a failed restart */
+                gettimeofday(&outage_start[dev], NULL);
+                outages[dev]++;
+                retry_delay[dev] = RETRY_DELAY_MIN;
+                retries[dev] = 0;
+        }
+
+        failed[dev] = 1;
+
+        /* Without a daemon to bring it back, a dead camera must not keep -c from finishing */
+        if (!daemon_mode && retries[dev]++ >= RETRY_MAX) {
+                fprintf(stderr, "%s: %s, giving up after %u restarts\n", dev_name[dev], what, RETRY_MAX);
+                given_up[dev] = 1;
+                return;
+        }
+
+        fprintf(stderr, "%s: %s, restarting in %u ms\n", dev_name[dev], what, retry_delay[dev]);
+
+        gettimeofday(&retry_time[dev], NULL);
+        delay.tv_sec = retry_delay[dev] / 1000;
+        delay.tv_usec = (retry_delay[dev] % 1000) * 1000;
+        timeradd(&retry_time[dev], &delay, &retry_time[dev]);
+
+        retry_delay[dev] *= 2;
+        if (retry_delay[dev] > RETRY_DELAY_MAX)
+                retry_delay[dev] = RETRY_DELAY_MAX;
+}
+
+/* Restarts can block in open() or S_FMT, keep them off the capture loop */
+static void *restart_thread(void *arg)
+{
+        unsigned char dev = (unsigned long)arg;
+
+        unpin_thread();
+        retry_result[dev] = -1 == open_device(dev) || -1 == init_device(dev) ||
+                            -1 == start_capturing(dev) ? -1 : 0;
+        if (1 != write(start_pipe[1], &dev, 1))
+                errno_exit("write");
+
+        return NULL;
+}
+
+/* Called by mainloop() once restart_thread() has reported back */
+static void restart_done(int dev)
+{
+        pthread_join(retry_thread[dev], NULL);
+        retrying[dev] = 0;
+
+        if (-1 == retry_result[dev])
+                device_failed(dev, "restart failed");
+}
+
+/* Restart failed devices that are due and give up on stalled ones */
+static void check_devices(void)
+{
+        struct timeval now;
+        int dev;
+
+        gettimeofday(&now, NULL);
+
+        for (dev = 0; dev < n_devs; dev++) {
+                if (starting[dev] || given_up[dev])
+                        continue;
+
+                if (failed[dev]) {
+                        if (timercmp(&now, &retry_time[dev], <))
+                                continue;
+
+                        failed[dev] = 0;
+                        starting[dev] = 1;
+                        retrying[dev] = 1;
+                        if (pthread_create(&retry_thread[dev], NULL, restart_thread,
+                                           (void *)(unsigned long)dev)) {
+                                fprintf(stderr, "Cannot create thread for %s\n", dev_name[dev]);
+                                exit(EXIT_FAILURE);
+                        }
+                } else if (streaming[dev] &&
+                           uSecElapsed(&now, &last_frame[dev]) >= timeout * 1000000UL) {
+                        device_failed(dev, "select timeout");
+                }
+        }
+}
+
+/* Time until the next failed device is due for a restart, capped at @tv */
+static void next_retry(struct timeval *tv)
+{
+        struct timeval now, left;
+        int dev;
+
+        gettimeofday(&now, NULL);
+
+        for (dev = 0; dev < n_devs; dev++) {
+                if (!failed[dev] || given_up[dev])
+                        continue;
+
+                if (timercmp(&retry_time[dev], &now, <))
+                        timerclear(&left);
+                else
+                        timersub(&retry_time[dev], &now, &left);
+
+                if (timercmp(&left, tv, <))
+                        *tv = left;
+        }
+}
+
+static void print_outages(void)
+{
+        struct timeval now;
+        int dev;
+
+        gettimeofday(&now, NULL);
+
+        for (dev = 0; dev < n_devs; dev++) {
+                unsigned long usec = outage_usec[dev];
+
+                if (!outages[dev])
+                        continue;
+
+                if (timerisset(&outage_start[dev]))
+                        usec += uSecElapsed(&now, &outage_start[dev]);
+
+                fprintf(stderr, "%s: %u outages, %lu ms without frames%s\n",
+                        dev_name[dev], outages[dev], usec / 1000,
+                        given_up[dev] ? ", given up" : failed[dev] ? ", still down" : "");
+        }
+}
+
+/*
+ * Restart @dev with the current crop/format/framerate settings.
+ * The device is kept open and its buffers mapped unless the new format
+ * does not fit into them; @reopen forces a full close/open cycle.
+ */
+static int restart_device(int dev, int reopen)
+{
+        struct v4l2_format fmt, req;
+
+        if (streaming[dev] && -1 == stop_capturing(dev))
+                return -1;
+
+        if (reopen) {
+                teardown_device(dev);
+                if (-1 == open_device(dev) || -1 == init_device(dev))
+                        return -1;
+        } else {
+                if (-1 == set_parm(dev) || -1 == get_format(dev, &req))
+                        return -1;
+
+                fmt = req;
+                if (req.fmt.pix.pixelformat != pix_req[dev].pixelformat ||
+                    req.fmt.pix.width != pix_req[dev].width ||
+                    req.fmt.pix.height != pix_req[dev].height) {
+                        /* vb2 refuses S_FMT with buffers allocated */
+                        if (-1 == set_format(dev, &fmt)) {
+                                if (EBUSY != errno)
+                                        return errno_fail(dev, "VIDIOC_S_FMT");
+                                fmt.fmt.pix.sizeimage = ~0U;
+                        }
+
+                        if (fmt.fmt.pix.sizeimage > (buffers[dev])[0].length) {
+                                /* Buffers don't fit the new format, reallocate */
+                                if (-1 == free_buffers(dev))
+                                        return -1;
+                                fmt = req;
+                                if (-1 == set_format(dev, &fmt))
+                                        return errno_fail(dev, "VIDIOC_S_FMT");
+                                if (-1 == init_buffers(fmt.fmt.pix.sizeimage, dev))
+                                        return -1;
+                        }
+                }
+        }
+
+        return start_capturing(dev);
+}
+
+static void reconfigure_device(int dev, int reopen)
+{
+        /* A failed device picks up the new settings when it is restarted */
+        if (failed[dev])
+                return;
+
+        gettimeofday(&reconf_time[dev], NULL);
+
+        if (-1 == restart_device(dev, reopen))
+                device_failed(dev, "reconfiguration failed");
+        else
+                reconf_pending[dev] = 1;
+}
+
+/* Names set by commands, reused so a long running daemon doesn't leak them */
+static char             cmd_format[256];
+static char             cmd_dev_name[N_DEVS_MAX][256];
+
+static void run_command(char *line)
+{
+        struct orientation o;
+        char arg[256];
+        int a, b, c, d, dev;
+
+        if (4 == sscanf(line, "crop %d %d %d %d", &a, &b, &c, &d)) {
+                /* The -Z header describes every frame in the file */
+                if (rec_fp && (c != WIDTH || d != HEIGHT)) {
+                        fprintf(stderr, "cannot change the frame size while recording\n");
+                        return;
+                }
+                LEFT = a;
+                TOP = b;
+                WIDTH = c;
+                HEIGHT = d;
+                for (dev = 0; dev < n_devs; dev++)
+                        reconfigure_device(dev, 0);
+        } else if (1 == sscanf(line, "format %255s", arg)) {
+                if (rec_fp && strcmp(arg, format_name)) {
+                        fprintf(stderr, "cannot change the format while recording\n");
+                        return;
+                }
+                strcpy(cmd_format, arg);
+                format_name = cmd_format;
+                for (dev = 0; dev < n_devs; dev++)
+                        reconfigure_device(dev, 0);
+        } else if (1 == sscanf(line, "framerate %d", &a)) {
+                framerate = a;
+                for (dev = 0; dev < n_devs; dev++)
+                        reconfigure_device(dev, 0);
+        } else if (2 == sscanf(line, "camera %d %255s", &dev, arg)) {
+                if (dev < 0 || dev >= n_devs) {
+                        fprintf(stderr, "no such device %d\n", dev);
+                        return;
+                }
+                strcpy(cmd_dev_name[dev], arg);
+                dev_name[dev] = cmd_dev_name[dev];
+                reconfigure_device(dev, 1);
+        } else if (1 == sscanf(line, "rate %255s", arg)) {
+                if (parse_rates(arg))
+                        fprintf(stderr, "bad rate\n");
+        } else if (2 == sscanf(line, "orient %d %255s", &dev, arg)) {
+                if (dev < 0 || dev >= n_devs || parse_orientation(arg, &o))
+                        fprintf(stderr, "bad orientation\n");
+                else
+                        orient[dev] = o;
+        } else if (1 == sscanf(line, "record %255s", arg)) {
+                out_buf = !strcmp(arg, "on");
+        } else if (!strcmp(line, "start")) {
+                for (dev = 0; dev < n_devs; dev++)
+                        if (!streaming[dev])
+                                reconfigure_device(dev, 0);
+        } else if (!strcmp(line, "stop")) {
+                for (dev = 0; dev < n_devs; dev++)
+                        if (streaming[dev] && -1 == stop_capturing(dev))
+                                device_failed(dev, "stop failed");
+        } else if (!strcmp(line, "quit")) {
+                quit = 1;
+        } else if (line[0]) {
+                fprintf(stderr, "unknown command '%s'\n", line);
+        }
+}
+
+static void handle_commands(void)
+{
+        static char line[256];
+        static int len;
+        ssize_t n;
+        char *nl;
+
+        n = read(cmd_fd, line + len, sizeof(line) - 1 - len);
+        if (-1 == n) {
+                if (EAGAIN == errno || EINTR == errno)
+                        return;
+                errno_exit("read");
+        }
+
+        if (0 == n) {
+                /* stdin closed */
+                quit = 1;
+                return;
+        }
+
+        len += n;
+        line[len] = 0;
+        while ((nl = strchr(line, '\n'))) {
+                *nl = 0;
+                run_command(line);
+                len -= nl + 1 - line;
+                memmove(line, nl + 1, len + 1);
+        }
+
+        if (len == sizeof(line) - 1) {
+                fprintf(stderr, "command too long\n");
+                len = 0;
+        }
+}
+
+static void open_cmd(void)
+{
+        if (daemon_mode) {
+                if (!strcmp(cmd_name, "-")) {
+                        cmd_fd = STDIN_FILENO;
+                } else {
+                        /* Keep a writer open ourselves so the FIFO never reports EOF */
+                        cmd_fd = open(cmd_name, O_RDWR | O_NONBLOCK, 0);
+                        if (-1 == cmd_fd) {
+                                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                                         cmd_name, errno, strerror(errno));
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        }
+}
+
+static void close_cmd(void)
+{
+        if (-1 != cmd_fd && STDIN_FILENO != cmd_fd)
+                close(cmd_fd);
+        cmd_fd = -1;
+}
+
+/*
+ * Real-time mode: lock all memory, fault in the capture buffers and the
+ * framebuffer up front, and run the capture loop SCHED_FIFO on the given
+ * CPUs, so neither page faults nor other tasks delay a dequeue.
+ */
+static void prefault(const void *start, size_t length)
+{
+        const volatile unsigned char *p = start;
+        long page = sysconf(_SC_PAGESIZE);
+        size_t i;
+
+        for (i = 0; i < length; i += page)
+                (void)p[i];
+}
+
+static void prefault_device(int dev)
+{
+        unsigned int i;
+
+        for (i = 0; i < n_buffers[dev]; i++)
+                prefault((buffers[dev])[i].start, (buffers[dev])[i].length);
+
+        /* READ i/o has a single buffer and doesn't count it */
+        if (IO_METHOD_READ == io)
+                prefault((buffers[dev])[0].start, (buffers[dev])[0].length);
+}
+
+static void prefault_stack(void)
+{
+        volatile unsigned char stack[256 * 1024];
+
+        memset((void *)stack, 0, sizeof(stack));
+}
+
+static void setup_rt(void)
+{
+        struct sched_param param;
+        cpu_set_t cpus;
+        char *p, *end;
+        int a, b;
+
+        if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+                errno_exit("mlockall");
+
+        prefault_stack();
+        if (out_fb)
+                prefault(fbmem, screensize);
+
+        if (rt_cpus) {
+                /* "0,2-3" */
+                CPU_ZERO(&cpus);
+                for (p = rt_cpus; *p; p = end + (*end == ',')) {
+                        a = b = strtol(p, &end, 0);
+                        if ('-' == *end)
+                                b = strtol(end + 1, &end, 0);
+                        if (end == p || (*end && ',' != *end)) {
+                                fprintf(stderr, "invalid cpu list '%s'\n", rt_cpus);
+                                exit(EXIT_FAILURE);
+                        }
+                        for (; a <= b; a++)
+                                CPU_SET(a, &cpus);
+                }
+                if (-1 == sched_getaffinity(0, sizeof(rt_all_cpus), &rt_all_cpus))
+                        errno_exit("sched_getaffinity");
+                /* Only this thread, helpers started later are unpinned */
+                if (-1 == sched_setaffinity(0, sizeof(cpus), &cpus))
+                        errno_exit("sched_setaffinity");
+                rt_pinned = 1;
+        }
+
+        CLEAR(param);
+        param.sched_priority = rt_prio;
+        if (-1 == sched_setscheduler(0, SCHED_FIFO, &param))
+                errno_exit("sched_setscheduler");
+}
+
+/*
+ * Threads inherit the capture thread's -a CPUs, which would queue remap
+ * helpers and restarts behind it. They keep its priority but may run
+ * anywhere the process could before.
+ */
+static void unpin_thread(void)
+{
+        if (rt_pinned && pthread_setaffinity_np(pthread_self(), sizeof(rt_all_cpus), &rt_all_cpus))
+                fprintf(stderr, "Cannot unpin helper thread\n");
+}
+
+/* Synthetic CPU and memory load for the jitter benchmark */
+static void *stress_thread(void *arg)
+{
+        size_t size = 64 << 20, i;
+        unsigned char *mem = malloc(size);
+        unsigned int x = (unsigned long)arg;
+
+        if (!mem)
+                return NULL;
+
+        for (;;) {
+                for (i = 0; i < size; i += 64) {
+                        x = x * 1103515245 + 12345;
+                        mem[i] += x;
+                }
+                memcpy(mem, mem + size / 2, size / 2);
+        }
+
+        return NULL;
+}
+
+static void start_stress(void)
+{
+        pthread_t thread;
+        int i;
+
+        for (i = 0; i < stress_threads; i++) {
+                if (pthread_create(&thread, NULL, stress_thread, (void *)(unsigned long)i)) {
+                        fprintf(stderr, "Cannot create stress thread\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+/*
+ * Replay: serve frames recorded with -o from a memory mapped file instead
+ * of V4L2 devices, straight out of the mapping. Geometry and format come
+ * from -W/-H/-f as for the capture; with -D every device plays the file
+ * from its own offset, looping as needed.
+ */
+static size_t frame_size(void)
+{
+        size_t pixels = (size_t)WIDTH * HEIGHT;
+
+        if (!strncmp(format_name, "rgb32", 5) || !strncmp(format_name, "raw10", 5))
+                return pixels * 4;
+        if (!strncmp(format_name, "y10p", 4))
+                return pixels * 5 / 4;
+        if (!strncmp(format_name, "grey", 4) || !strncmp(format_name, "bggr8", 5))
+                return pixels;
+        if (!strncmp(format_name, "nv12", 4))
+                return pixels * 3 / 2;
+
+        /* uyvy, yuyv, rgb565, nv16, y10, y12, bggr12 */
+        return pixels * 2;
+}
+
+static void replay(void)
+{
+        struct timespec t0, t1, next;
+        struct timeval ts;
+        unsigned char *data;
+        struct stat st;
+        size_t fsize, nframes, idx;
+        unsigned int n;
+        long period = 0;
+        double sec;
+        int rfd, dev, fps;
+
+        rfd = open(replay_name, O_RDONLY);
+        if (-1 == rfd || -1 == fstat(rfd, &st)) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                         replay_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        fsize = frame_size();
+        nframes = st.st_size / fsize;
+        if (!nframes) {
+                fprintf(stderr, "%s: smaller than one %dx%d %s frame\n",
+                        replay_name, WIDTH, HEIGHT, format_name);
+                exit(EXIT_FAILURE);
+        }
+        if (st.st_size % fsize)
+                fprintf(stderr, "%s: %ld trailing bytes ignored, check -f/-W/-H\n",
+                        replay_name, (long)(st.st_size % fsize));
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rfd, 0);
+        if (MAP_FAILED == data)
+                errno_exit("mmap");
+        madvise(data, st.st_size, MADV_WILLNEED);
+
+        /* Recorded at -s, or the camera default of 30 fps */
+        fps = replay_fps >= 0 ? replay_fps : framerate ? framerate : 30;
+        if (fps)
+                period = 1000000000L / fps;
+
+        fprintf(stderr, "%s: %zu frames of %zu bytes, %s\n", replay_name, nframes, fsize,
+                fps ? "paced" : "as fast as possible");
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        next = t0;
+
+        for (n = 0; n < (unsigned int)frame_count; n++) {
+                for (dev = 0; dev < n_devs; dev++) {
+                        idx = (n + dev * nframes / n_devs) % nframes;
+                        record_dequeue(dev);
+                        trace_seq[dev] = n;
+                        monotonic_timeval(&ts);
+                        process_image(data + idx * fsize, fsize, dev, &ts);
+                        if (fps_count)
+                                fpsCount(dev);
+                }
+
+                if (period) {
+                        next.tv_nsec += period;
+                        if (next.tv_nsec >= 1000000000L) {
+                                next.tv_sec++;
+                                next.tv_nsec -= 1000000000L;
+                        }
+                        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL))
+                                ;
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        fprintf(stderr, "replayed %d x %d frames in %.3f s: %.1f fps per device, %.1f fps, %.1f MB/s total\n",
+                frame_count, n_devs, sec, frame_count / sec, frame_count * n_devs / sec,
+                (double)fsize * frame_count * n_devs / sec / 1e6);
+
+        munmap(data, st.st_size);
+        close(rfd);
+}
+
+/* Expand one recorded chunk of @n raw bytes, returns -1 if it is corrupt */
+static int rec_expand_chunk(const unsigned char *in, uint32_t clen, unsigned char *out,
+                            size_t n, unsigned char *tmp, uint32_t pred)
+{
+        unsigned char *dst = pred ? tmp : out;
+
+        if (clen & REC_STORED) {
+                if ((clen & ~REC_STORED) != n)
+                        return -1;
+                memcpy(dst, in, n);
+        } else if (lz4_decompress(in, clen, dst, n) != (long)n) {
+                return -1;
+        }
+
+        if (pred)
+                unpredict(tmp, out, n, pred >> 8, pred & 0xff);
+
+        return 0;
+}
+
+/* Write the frames of a -Z recording to stdout, as -o would have */
+static void decompress(void)
+{
+        struct rec_frame_header fh;
+        struct rec_header hdr;
+        unsigned char *in = NULL, *out = NULL, *tmp;
+        uint32_t *clen = NULL;
+        unsigned long frames = 0;
+        size_t alloc = 0, off, n;
+        unsigned int c;
+        FILE *fp;
+
+        fp = fopen(unpack_name, "rb");
+        if (!fp) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                         unpack_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (1 != fread(&hdr, sizeof(hdr), 1, fp) || memcmp(hdr.magic, "CAPZ", 4) ||
+            1 != hdr.version || hdr.chunk_size != REC_CHUNK) {
+                fprintf(stderr, "%s: not a recording\n", unpack_name);
+                exit(EXIT_FAILURE);
+        }
+        hdr.format[sizeof(hdr.format) - 1] = '\0';
+        fprintf(stderr, "%s: %ux%u %s\n", unpack_name, hdr.width, hdr.height, hdr.format);
+
+        in = malloc(LZ4_BOUND(REC_CHUNK));
+        tmp = malloc(REC_CHUNK);
+        if (!in || !tmp) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        while (1 == fread(&fh, sizeof(fh), 1, fp)) {
+                if (fh.chunks != (fh.size + REC_CHUNK - 1) / REC_CHUNK)
+                        goto corrupt;
+
+                if (fh.size > alloc) {
+                        free(out);
+                        free(clen);
+                        out = malloc(fh.size);
+                        clen = malloc(fh.chunks * sizeof(*clen));
+                        if (!out || !clen) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        alloc = fh.size;
+                }
+
+                if (fh.chunks != fread(clen, sizeof(*clen), fh.chunks, fp))
+                        goto corrupt;
+
+                for (c = 0, off = 0; c < fh.chunks; c++, off += n) {
+                        n = fh.size - off < REC_CHUNK ? fh.size - off : REC_CHUNK;
+                        if ((clen[c] & ~REC_STORED) > LZ4_BOUND(REC_CHUNK) ||
+                            1 != fread(in, clen[c] & ~REC_STORED, 1, fp) ||
+                            rec_expand_chunk(in, clen[c], out + off, n, tmp, hdr.predictor))
+                                goto corrupt;
+                }
+
+                fwrite(out, fh.size, 1, stdout);
+                frames++;
+        }
+
+        if (!feof(fp)) {
+corrupt:
+                fprintf(stderr, "%s: corrupt after %lu frames\n", unpack_name, frames);
+                exit(EXIT_FAILURE);
+        }
+
+        fprintf(stderr, "%lu frames\n", frames);
+        fclose(fp);
+        free(in);
+        free(tmp);
+        free(out);
+        free(clen);
+}
+
+/*
+ * Media controller setup from a topology file, instead of a media-ctl
+ * run per link. The graph is enumerated once, links are only touched if
+ * they aren't in the wanted state, and the formats reaching every VIN
+ * are checked against -f/-W/-H before any device is started.
+ *
+ *      media /dev/media0
+ *      link 'rcar_csi2 feaa0000.csi2':1 -> 'VIN0 output':0 [1]
+ *      fmt 'rcar_csi2 feaa0000.csi2':1 Y10_1X10/1920x1020
+ */
+struct media_entity {
+        struct media_entity_desc desc;
+        struct media_pad_desc *pads;
+        struct media_link_desc *links;
+        int             subdev_fd;
+};
 
-        case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers[dev]; ++i) {
-                        struct v4l2_buffer buf;
+static struct media_entity *media_ent;
+static int              media_n_ents;
+
+static const struct {
+        const char     *name;
+        unsigned int    code;
+        const char     *formats;        /* capture formats a VIN makes of it */
+} mbus_codes[] = {
+        { "UYVY8_2X8",      MEDIA_BUS_FMT_UYVY8_2X8,      "uyvy yuyv rgb565 rgb32 nv12 nv16" },
+        { "UYVY8_1X16",     MEDIA_BUS_FMT_UYVY8_1X16,     "uyvy yuyv rgb565 rgb32 nv12 nv16" },
+        { "YUYV8_2X8",      MEDIA_BUS_FMT_YUYV8_2X8,      "uyvy yuyv rgb565 rgb32 nv12 nv16" },
+        { "YUYV8_1X16",     MEDIA_BUS_FMT_YUYV8_1X16,     "uyvy yuyv rgb565 rgb32 nv12 nv16" },
+        { "RGB888_1X24",    MEDIA_BUS_FMT_RGB888_1X24,    "rgb32 rgb565" },
+        { "ARGB8888_1X32",  MEDIA_BUS_FMT_ARGB8888_1X32,  "rgb32 rgb565" },
+        { "Y8_1X8",         MEDIA_BUS_FMT_Y8_1X8,         "grey" },
+        { "Y10_1X10",       MEDIA_BUS_FMT_Y10_1X10,       "y10 y10p raw10" },
+        { "Y12_1X12",       MEDIA_BUS_FMT_Y12_1X12,       "y12" },
+        { "SBGGR8_1X8",     MEDIA_BUS_FMT_SBGGR8_1X8,     "bggr8" },
+        { "SBGGR12_1X12",   MEDIA_BUS_FMT_SBGGR12_1X12,   "bggr12" },
+};
 
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_USERPTR;
-                        buf.index = i;
-                        buf.m.userptr = (unsigned long)(buffers[dev])[i].start;
-                        buf.length = (buffers[dev])[i].length;
+static void media_fail(const char *file, int ln, const char *what)
+{
+        fprintf(stderr, "%s:%d: %s\n", file, ln, what);
+        exit(EXIT_FAILURE);
+}
 
-                        if (-1 == xioctl(fd[dev], VIDIOC_QBUF, &buf))
-                                errno_exit("VIDIOC_QBUF");
+/* Every entity with its pads and outgoing links, in one pass */
+static void media_enumerate(int mfd)
+{
+        struct media_entity_desc desc;
+        struct media_links_enum links;
+        struct media_entity *e;
+
+        CLEAR(desc);
+        for (desc.id = MEDIA_ENT_ID_FLAG_NEXT; !xioctl(mfd, MEDIA_IOC_ENUM_ENTITIES, &desc);
+             desc.id |= MEDIA_ENT_ID_FLAG_NEXT) {
+                media_ent = realloc(media_ent, (media_n_ents + 1) * sizeof(*media_ent));
+                if (!media_ent) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
                 }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd[dev], VIDIOC_STREAMON, &type))
-                        errno_exit("VIDIOC_STREAMON");
-                break;
+                e = &media_ent[media_n_ents++];
+                CLEAR(*e);
+                e->desc = desc;
+                e->subdev_fd = -1;
+                e->pads = calloc(desc.pads + 1, sizeof(*e->pads));
+                e->links = calloc(desc.links + 1, sizeof(*e->links));
+                if (!e->pads || !e->links) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                CLEAR(links);
+                links.entity = desc.id;
+                links.pads = e->pads;
+                links.links = e->links;
+                if (-1 == xioctl(mfd, MEDIA_IOC_ENUM_LINKS, &links))
+                        errno_exit("MEDIA_IOC_ENUM_LINKS");
         }
+        if (EINVAL != errno)
+                errno_exit("MEDIA_IOC_ENUM_ENTITIES");
 }
 
-static void uninit_device(int dev)
+static struct media_entity *media_find(const char *name)
 {
-        unsigned int i;
+        int i;
 
-        switch (io) {
-        case IO_METHOD_READ:
-                free((buffers[dev])[0].start);
-                break;
+        for (i = 0; i < media_n_ents; i++)
+                if (!strcmp(media_ent[i].desc.name, name))
+                        return &media_ent[i];
 
-        case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers[dev]; ++i)
-                        if (-1 == munmap((buffers[dev])[i].start, (buffers[dev])[i].length))
-                                errno_exit("munmap");
-                break;
+        return NULL;
+}
 
-        case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers[dev]; ++i)
-                        free((buffers[dev])[i].start);
-                break;
-        }
+/* 'entity name':pad, quoted with ' or " */
+static struct media_entity *media_parse_pad(char **s, int *pad)
+{
+        struct media_entity *e;
+        char *p = *s + strspn(*s, " \t"), *end, q = *p;
 
-        free(buffers[dev]);
+        if (('\'' != q && '"' != q) || !(end = strchr(p + 1, q)) || ':' != end[1])
+                return NULL;
+
+        *end = '\0';
+        e = media_find(p + 1);
+        *pad = strtol(end + 2, s, 10);
+        if (e && (*pad < 0 || *pad >= e->desc.pads))
+                return NULL;
+
+        return e;
 }
 
-static void init_read(unsigned int buffer_size, int dev)
+/* The v4l-subdev node of an entity, through sysfs */
+static int media_subdev(struct media_entity *e)
 {
-        buffers[dev] = calloc(1, sizeof(*buffers[dev]));
+        char path[64], link[256], *node;
+        ssize_t n;
 
-        if (!buffers[dev]) {
-                fprintf(stderr, "Out of memory\n");
+        if (-1 != e->subdev_fd)
+                return e->subdev_fd;
+
+        snprintf(path, sizeof(path), "/sys/dev/char/%u:%u", e->desc.dev.major, e->desc.dev.minor);
+        n = readlink(path, link, sizeof(link) - 1);
+        if (-1 == n)
+                return -1;
+        link[n] = '\0';
+
+        node = strrchr(link, '/');
+        if (!node || strncmp(node + 1, "v4l-subdev", 10))
+                return -1;
+        snprintf(path, sizeof(path), "/dev/%s", node + 1);
+        e->subdev_fd = open(path, O_RDWR);
+
+        return e->subdev_fd;
+}
+
+static void media_link(int mfd, const char *file, int ln, char *s)
+{
+        struct media_entity *src, *sink;
+        struct media_link_desc *l = NULL;
+        int sp, kp, i, enable = 1;
+
+        src = media_parse_pad(&s, &sp);
+        s += strspn(s, " \t");
+        if (strncmp(s, "->", 2))
+                media_fail(file, ln, "expected 'source':pad -> 'sink':pad [0|1]");
+        s += 2;
+        sink = media_parse_pad(&s, &kp);
+        if (!src || !sink)
+                media_fail(file, ln, "no such entity or pad");
+        sscanf(s, " [%d]", &enable);
+
+        for (i = 0; i < src->desc.links; i++)
+                if (src->links[i].source.index == sp && src->links[i].sink.entity == sink->desc.id &&
+                    src->links[i].sink.index == kp)
+                        l = &src->links[i];
+        if (!l)
+                media_fail(file, ln, "no such link");
+
+        /* Already as wanted, or can't change anyway */
+        if (!!(l->flags & MEDIA_LNK_FL_ENABLED) == !!enable)
+                return;
+        if (l->flags & MEDIA_LNK_FL_IMMUTABLE)
+                media_fail(file, ln, "link is immutable");
+
+        l->flags = enable ? l->flags | MEDIA_LNK_FL_ENABLED : l->flags & ~MEDIA_LNK_FL_ENABLED;
+        if (-1 == xioctl(mfd, MEDIA_IOC_SETUP_LINK, l)) {
+                fprintf(stderr, "%s:%d: MEDIA_IOC_SETUP_LINK error %d, %s\n",
+                        file, ln, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
+}
 
-        (buffers[dev])[0].length = buffer_size;
-        (buffers[dev])[0].start = malloc(sizeof(unsigned char) * buffer_size);
+static void media_format(const char *file, int ln, char *s)
+{
+        struct v4l2_subdev_format fmt;
+        struct media_entity *e;
+        char code[32];
+        unsigned int i, w, h;
+        int pad, sfd;
+
+        e = media_parse_pad(&s, &pad);
+        if (!e)
+                media_fail(file, ln, "no such entity or pad");
+        if (3 != sscanf(s, " %31[A-Z0-9_]/%ux%u", code, &w, &h))
+                media_fail(file, ln, "expected 'entity':pad CODE/WIDTHxHEIGHT");
+
+        for (i = 0; i < sizeof(mbus_codes) / sizeof(mbus_codes[0]); i++)
+                if (!strcmp(mbus_codes[i].name, code))
+                        break;
+        if (i == sizeof(mbus_codes) / sizeof(mbus_codes[0]))
+                media_fail(file, ln, "unknown media bus format");
 
-        if (!(buffers[dev])[0].start) {
-                fprintf(stderr, "Out of memory\n");
+        sfd = media_subdev(e);
+        if (-1 == sfd)
+                media_fail(file, ln, "entity has no subdevice node");
+
+        CLEAR(fmt);
+        fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+        fmt.pad = pad;
+        fmt.format.code = mbus_codes[i].code;
+        fmt.format.width = w;
+        fmt.format.height = h;
+        fmt.format.field = V4L2_FIELD_NONE;
+        if (-1 == xioctl(sfd, VIDIOC_SUBDEV_S_FMT, &fmt)) {
+                fprintf(stderr, "%s:%d: VIDIOC_SUBDEV_S_FMT error %d, %s\n",
+                        file, ln, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
+
+        /* Drivers adjust rather than fail */
+        if (fmt.format.code != mbus_codes[i].code || fmt.format.width != w || fmt.format.height != h)
+                fprintf(stderr, "%s:%d: %s:%d set to 0x%04x/%ux%u\n", file, ln, e->desc.name,
+                        pad, fmt.format.code, fmt.format.width, fmt.format.height);
 }
 
-static void init_mmap(int dev)
+/* What reaches each capture device must be able to give -f/-W/-H */
+static int media_check(void)
 {
-        struct v4l2_requestbuffers req;
+        struct v4l2_subdev_format fmt;
+        struct media_entity *e, *src;
+        struct stat st;
+        unsigned int i;
+        int dev, j, k, err = 0;
 
-        CLEAR(req);
+        for (dev = 0; dev < n_devs; dev++) {
+                if (-1 == stat(dev_name[dev], &st)) {
+                        fprintf(stderr, "%s: cannot check format: %d, %s\n",
+                                dev_name[dev], errno, strerror(errno));
+                        err = -1;
+                        continue;
+                }
 
-        req.count = 7;
-        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        req.memory = V4L2_MEMORY_MMAP;
+                for (e = NULL, j = 0; j < media_n_ents && !e; j++)
+                        if (media_ent[j].desc.dev.major == major(st.st_rdev) &&
+                            media_ent[j].desc.dev.minor == minor(st.st_rdev))
+                                e = &media_ent[j];
+                if (!e) {
+                        fprintf(stderr, "%s: not in the media graph, format not checked\n",
+                                dev_name[dev]);
+                        continue;
+                }
 
-        if (-1 == xioctl(fd[dev], VIDIOC_REQBUFS, &req)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s does not support "
-                                 "memory mapping\n", dev_name[dev]);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_REQBUFS");
+                /* The enabled link into the video node */
+                for (src = NULL, j = 0; j < media_n_ents && !src; j++)
+                        for (k = 0; k < media_ent[j].desc.links; k++)
+                                if (media_ent[j].links[k].sink.entity == e->desc.id &&
+                                    (media_ent[j].links[k].flags & MEDIA_LNK_FL_ENABLED)) {
+                                        src = &media_ent[j];
+                                        break;
+                                }
+                if (!src) {
+                        fprintf(stderr, "%s: no enabled link into %s\n", dev_name[dev], e->desc.name);
+                        err = -1;
+                        continue;
+                }
+                if (-1 == media_subdev(src)) {
+                        fprintf(stderr, "%s: %s has no subdevice node, format not checked\n",
+                                dev_name[dev], src->desc.name);
+                        continue;
+                }
+
+                CLEAR(fmt);
+                fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+                fmt.pad = src->links[k].source.index;
+                if (-1 == xioctl(src->subdev_fd, VIDIOC_SUBDEV_G_FMT, &fmt)) {
+                        fprintf(stderr, "%s: %s:%d VIDIOC_SUBDEV_G_FMT error %d, %s, format not checked\n",
+                                dev_name[dev], src->desc.name, fmt.pad, errno, strerror(errno));
+                        continue;
+                }
+
+                for (i = 0; i < sizeof(mbus_codes) / sizeof(mbus_codes[0]); i++)
+                        if (mbus_codes[i].code == fmt.format.code)
+                                break;
+                if (i == sizeof(mbus_codes) / sizeof(mbus_codes[0]) ||
+                    !strstr(mbus_codes[i].formats, format_name)) {
+                        fprintf(stderr, "%s: %s:%d sends 0x%04x, no %s\n", dev_name[dev],
+                                src->desc.name, fmt.pad, fmt.format.code, format_name);
+                        err = -1;
+                }
+                if (fmt.format.width < (unsigned int)(LEFT + WIDTH) ||
+                    fmt.format.height < (unsigned int)(TOP + HEIGHT)) {
+                        fprintf(stderr, "%s: %s:%d sends %ux%u, too small for %dx%d at %d,%d\n",
+                                dev_name[dev], src->desc.name, fmt.pad, fmt.format.width,
+                                fmt.format.height, WIDTH, HEIGHT, LEFT, TOP);
+                        err = -1;
                 }
         }
 
-        if (req.count < 2) {
-                fprintf(stderr, "Insufficient buffer memory on %s\n",
-                         dev_name[dev]);
+        return err;
+}
+
+static int media_open(const char *name)
+{
+        int mfd = open(name, O_RDWR);
+
+        if (-1 == mfd) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
+        media_enumerate(mfd);
 
-        buffers[dev] = calloc(req.count, sizeof(*buffers[dev]));
+        return mfd;
+}
 
-        if (!buffers[dev]) {
-                fprintf(stderr, "Out of memory\n");
+static void media_setup(const char *file)
+{
+        char line[512], media_name[256] = "/dev/media0", *s;
+        struct timeval t0, t1;
+        int mfd = -1, ln = 0, links = 0, formats = 0, i;
+        FILE *fp;
+
+        gettimeofday(&t0, NULL);
+
+        fp = fopen(file, "r");
+        if (!fp) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n", file, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
 
-        for (n_buffers[dev] = 0; n_buffers[dev] < req.count; ++n_buffers[dev]) {
-                struct v4l2_buffer buf;
+        while (fgets(line, sizeof(line), fp)) {
+                ln++;
+                s = line + strspn(line, " \t");
+                if ('#' == *s || '\n' == *s || !*s)
+                        continue;
 
-                CLEAR(buf);
+                if (1 == sscanf(s, "media %255s", media_name)) {
+                        if (-1 != mfd)
+                                media_fail(file, ln, "one media device per file");
+                        continue;
+                }
 
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = n_buffers[dev];
+                if (-1 == mfd)
+                        mfd = media_open(media_name);
 
-                if (-1 == xioctl(fd[dev], VIDIOC_QUERYBUF, &buf))
-                        errno_exit("VIDIOC_QUERYBUF");
+                if (!strncmp(s, "link ", 5)) {
+                        media_link(mfd, file, ln, s + 5);
+                        links++;
+                } else if (!strncmp(s, "fmt ", 4)) {
+                        media_format(file, ln, s + 4);
+                        formats++;
+                } else {
+                        media_fail(file, ln, "expected media, link or fmt");
+                }
+        }
+        fclose(fp);
 
-                (buffers[dev])[n_buffers[dev]].length = buf.length;
-                (buffers[dev])[n_buffers[dev]].start =
-                        mmap(NULL /* start anywhere */,
-                              buf.length,
-                              PROT_READ | PROT_WRITE /* required */,
-                              MAP_SHARED /* recommended */,
-                              fd[dev], buf.m.offset);
+        /* Nothing to set up, the pipeline is still checked against the devices */
+        if (-1 == mfd)
+                mfd = media_open(media_name);
 
-                if (MAP_FAILED == (buffers[dev])[n_buffers[dev]].start)
-                        errno_exit("mmap");
+        if (media_check())
+                exit(EXIT_FAILURE);
+
+        gettimeofday(&t1, NULL);
+        fprintf(stderr, "%s: %d entities, %d links, %d formats set up in %lu us\n",
+                media_name, media_n_ents, links, formats, uSecElapsed(&t1, &t0));
+
+        for (i = 0; i < media_n_ents; i++) {
+                if (-1 != media_ent[i].subdev_fd)
+                        close(media_ent[i].subdev_fd);
+                free(media_ent[i].pads);
+                free(media_ent[i].links);
         }
+        free(media_ent);
+        media_ent = NULL;
+        media_n_ents = 0;
+        close(mfd);
 }
 
-static void init_userp(unsigned int buffer_size, int dev)
+static void bring_up(int dev)
 {
-        struct v4l2_requestbuffers req;
+        if (-1 == open_device(dev))
+                exit(EXIT_FAILURE);
+        gettimeofday(&timeline[dev][PHASE_OPEN], NULL);
+        if (-1 == init_device(dev))
+                exit(EXIT_FAILURE);
+        gettimeofday(&timeline[dev][PHASE_INIT], NULL);
+        if (-1 == start_capturing(dev))
+                exit(EXIT_FAILURE);
+        gettimeofday(&timeline[dev][PHASE_STREAMON], NULL);
+}
 
-        CLEAR(req);
+static void *bring_up_thread(void *arg)
+{
+        unsigned char dev = (unsigned long)arg;
 
-        req.count  = 4;
-        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        req.memory = V4L2_MEMORY_USERPTR;
+        bring_up(dev);
+        if (1 != write(start_pipe[1], &dev, 1))
+                errno_exit("write");
 
-        if (-1 == xioctl(fd[dev], VIDIOC_REQBUFS, &req)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s does not support "
-                                 "user pointer i/o\n", dev_name[dev]);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_REQBUFS");
-                }
-        }
+        return NULL;
+}
 
-        buffers[dev] = calloc(4, sizeof(*buffers[dev]));
+/*
+ * Open, initialise and start every device. With parallel_start each device
+ * is brought up by its own thread and mainloop() starts polling it as soon
+ * as it reports back, so the first cameras are shown while others still
+ * negotiate formats and allocate buffers.
+ */
+static void start_devices(void)
+{
+        int dev;
 
-        if (!buffers[dev]) {
-                fprintf(stderr, "Out of memory\n");
-                exit(EXIT_FAILURE);
-        }
+        gettimeofday(&start_time, NULL);
 
-        for (n_buffers[dev] = 0; n_buffers[dev] < 4; ++n_buffers[dev]) {
-                (buffers[dev])[n_buffers[dev]].length = buffer_size;
-                (buffers[dev])[n_buffers[dev]].start = malloc(buffer_size);
+        /* Also used by restarts after a device failed */
+        if (-1 == pipe(start_pipe))
+                errno_exit("pipe");
 
-                if (!(buffers[dev])[n_buffers[dev]].start) {
-                        fprintf(stderr, "Out of memory\n");
+        if (!parallel_start) {
+                for (dev = 0; dev < n_devs; dev++)
+                        bring_up(dev);
+                return;
+        }
+
+        for (dev = 0; dev < n_devs; dev++) {
+                starting[dev] = 1;
+                if (pthread_create(&start_thread[dev], NULL, bring_up_thread,
+                                   (void *)(unsigned long)dev)) {
+                        fprintf(stderr, "Cannot create thread for %s\n", dev_name[dev]);
                         exit(EXIT_FAILURE);
                 }
         }
 }
 
-static void init_device(int dev)
+static void join_devices(void)
 {
-        struct v4l2_capability cap;
-        struct v4l2_cropcap cropcap;
-        struct v4l2_crop crop;
-        struct v4l2_format fmt;
+        int dev;
 
-        if (-1 == xioctl(fd[dev], VIDIOC_QUERYCAP, &cap)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s is no V4L2 device\n",
-                                 dev_name[dev]);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_QUERYCAP");
+        for (dev = 0; dev < n_devs; dev++) {
+                if (parallel_start)
+                        pthread_join(start_thread[dev], NULL);
+                if (retrying[dev]) {
+                        pthread_join(retry_thread[dev], NULL);
+                        retrying[dev] = 0;
+                        if (-1 == retry_result[dev])
+                                teardown_device(dev);
                 }
+                starting[dev] = 0;
         }
 
-        if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-                fprintf(stderr, "%s is no video capture device\n",
-                         dev_name[dev]);
+        close(start_pipe[0]);
+        close(start_pipe[1]);
+        start_pipe[0] = start_pipe[1] = -1;
+}
+
+/*
+ * Benchmarks, run with -B instead of capturing. Geometry comes from -W/-H,
+ * the number of frames from -c, and -F runs them on the real framebuffer.
+ */
+static void bench_report(const char *what, struct timeval *t0, size_t bytes)
+{
+        struct timeval t;
+        unsigned long usec;
+
+        gettimeofday(&t, NULL);
+        usec = uSecElapsed(&t, t0) ? : 1;
+        fprintf(stderr, "%-32s %8.3f ms/frame %8.1f MB/s\n", what,
+                usec / 1000.0 / frame_count, (double)bytes * frame_count / usec);
+}
+
+static unsigned char *bench_frame(size_t size)
+{
+        unsigned char *buf = malloc(size);
+        size_t i;
+
+        if (!buf) {
+                fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
 
-        switch (io) {
-        case IO_METHOD_READ:
-                if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-                        fprintf(stderr, "%s does not support read i/o\n",
-                                 dev_name[dev]);
-                        exit(EXIT_FAILURE);
-                }
-                break;
+        for (i = 0; i < size; i++)
+                buf[i] = rand();
 
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
-                if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-                        fprintf(stderr, "%s does not support streaming i/o\n",
-                                 dev_name[dev]);
-                        exit(EXIT_FAILURE);
-                }
-                break;
+        return buf;
+}
+
+/* Destination tile for benchmarks: the framebuffer with -F, else plain memory */
+static unsigned char *bench_tile(int *w, int *h)
+{
+        if (out_fb) {
+                open_fb();
+        } else {
+                fprintf(stderr, "no framebuffer (-F), using cached memory\n");
+                finfo.line_length = WIDTH * 4;
+                screensize = (long)WIDTH * 4 * HEIGHT;
+                fbmem = (char *)bench_frame(screensize);
         }
 
+        return fb_tile(0, w, h);
+}
 
-        /* Select video input, video standard and tune here. */
-        CLEAR(cropcap);
-        cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (0 == xioctl(fd[dev], VIDIOC_CROPCAP, &cropcap)) {
-                crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                crop.c = cropcap.defrect; /* reset to default */
+static void bench_blit(void)
+{
+        unsigned char *src, *dst, *line;
+        volatile unsigned char *d;
+        struct timeval t0;
+        int i, j, n, w, h;
+
+        dst = bench_tile(&w, &h);
+        src = bench_frame((size_t)WIDTH * 4 * HEIGHT);
+        line = get_scratch(w * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                for (i = 0; i < h; i++)
+                        uyvy_to_rgb32(src + i * WIDTH * 2, dst + i * finfo.line_length, w);
+        bench_report("uyvy, byte stores", &t0, (size_t)w * h * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        uyvy_to_rgb32(src + i * WIDTH * 2, line, w);
+                        blit_line(dst + i * finfo.line_length, line, w * 4);
+                }
+                blit_flush();
+        }
+        bench_report("uyvy, scratch line + blit", &t0, (size_t)w * h * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        d = dst + i * finfo.line_length;
+                        for (j = 0; j < w * 4; j++)
+                                d[j] = src[i * WIDTH * 4 + j];
+                }
+        }
+        bench_report("rgb32, byte stores", &t0, (size_t)w * h * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                for (i = 0; i < h; i++)
+                        memcpy(dst + i * finfo.line_length, src + i * WIDTH * 4, w * 4);
+        bench_report("rgb32, memcpy", &t0, (size_t)w * h * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++)
+                        blit_line(dst + i * finfo.line_length, src + i * WIDTH * 4, w * 4);
+                blit_flush();
+        }
+        bench_report("rgb32, blit", &t0, (size_t)w * h * 4);
+}
 
-                crop.c.left = LEFT;
-                crop.c.top = TOP;
-                crop.c.width = WIDTH;
-                crop.c.height = HEIGHT;
+/* Known 10/12 bit patterns through the unpack and tone mapping paths */
+static int y10_selftest(void)
+{
+        static const unsigned char packed[10] = {
+                0x12, 0x34, 0x56, 0x78, 0xe4,
+                0xff, 0x00, 0x80, 0x01, 0x1b,
+        };
+        static const unsigned short unpacked[8] = {
+                0x048, 0x0d1, 0x15a, 0x1e3, 0x3ff, 0x002, 0x201, 0x004,
+        };
+        static const unsigned short grey[16] = {
+                0, 3, 4, 511, 512, 1020, 1023, 1023, 4, 8, 12, 16, 1000, 1001, 1002, 1003,
+        };
+        unsigned short out16[16];
+        unsigned int out[16];
+        int i, err = 0;
+
+        y10p_unpack(packed, out16, 8);
+        for (i = 0; i < 8; i++)
+                if (out16[i] != unpacked[i]) {
+                        fprintf(stderr, "y10p unpack [%d]: %#x, expected %#x\n", i, out16[i], unpacked[i]);
+                        err++;
+                }
 
-                if (-1 == xioctl(fd[dev], VIDIOC_S_CROP, &crop)) {
-                        switch (errno) {
-                        case EINVAL:
-                                /* Cropping not supported. */
-                                break;
-                        default:
-                                /* Errors ignored. */
-                                break;
-                        }
+        tonemap_name = "shift";
+        build_tonemap(10);
+        grey16_to_rgb32(grey, out, 16);
+        for (i = 0; i < 16; i++)
+                if (out[i] != (grey[i] >> 2) * 0x010101u) {
+                        fprintf(stderr, "y10 shift [%d]: %#x, expected %#x\n", i, out[i], (grey[i] >> 2) * 0x010101u);
+                        err++;
                 }
-        } else {
-                /* Errors ignored. */
-        }
 
-        if (framerate) {
-            struct v4l2_streamparm parm;
+        y10p_to_rgb32(packed, out, out16, 8);
+        for (i = 0; i < 8; i++)
+                if (out[i] != (unpacked[i] >> 2) * 0x010101u) {
+                        fprintf(stderr, "y10p shift [%d]: %#x, expected %#x\n", i, out[i], (unpacked[i] >> 2) * 0x010101u);
+                        err++;
+                }
 
-            parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            if (-1 == xioctl(fd[dev], VIDIOC_G_PARM, &parm))
-                errno_exit("VIDIOC_G_PARM");
+        tonemap_name = "shift:0";
+        build_tonemap(10);
+        grey16_to_rgb32(grey, out, 16);
+        if (out[2] != 0x040404 || out[3] != 0xffffff) {
+                fprintf(stderr, "y10 shift:0 does not saturate\n");
+                err++;
+        }
 
-            parm.parm.capture.timeperframe.numerator = 1;
-            parm.parm.capture.timeperframe.denominator = framerate;
-            if (-1 == xioctl(fd[dev], VIDIOC_S_PARM, &parm))
-                errno_exit("VIDIOC_S_PARM");
+        tonemap_name = "gamma:1";
+        build_tonemap(10);
+        grey16_to_rgb32(grey, out, 16);
+        if (out[0] != 0 || out[4] != 0x808080 || out[6] != 0xffffff) {
+                fprintf(stderr, "y10 gamma:1 is not linear\n");
+                err++;
         }
 
-#if 0
-    struct v4l2_control control;
+        tonemap_name = "shift";
+        build_tonemap(12);
+        grey16_to_rgb32(grey, out, 16);
+        if (out[6] != 0x3f3f3f || out[11] != 0x010101) {
+                fprintf(stderr, "y12 shift is not by 4\n");
+                err++;
+        }
+
+        fprintf(stderr, "y10 self test %s\n", err ? "FAILED" : "passed");
+        return err;
+}
 
-    memset(&control, 0, sizeof (control));
-    control.id = V4L2_CID_BRIGHTNESS;
-//    control.id = V4L2_CID_VFLIP;
-//    control.id = V4L2_CID_CONTRAST;
-//    control.id = V4L2_CID_SATURATION;
-//    control.id = V4L2_CID_GAMMA;
-//    control.id = V4L2_CID_GAIN;
-//    control.id = V4L2_CID_EXPOSURE;
-//    control.id = V4L2_CID_AUTOGAIN;
+static void bench_y10(void)
+{
+        unsigned char *src, *dst, *line;
+        char *map = tonemap_name;
+        struct timeval t0;
+        int i, n, w, h;
 
-    if (-1 == xioctl(fd[dev], VIDIOC_G_CTRL, &control))
-        errno_exit("VIDIOC_G_CTRL");
+        if (y10_selftest())
+                exit(EXIT_FAILURE);
 
-    control.value = 0xf0;
+        dst = bench_tile(&w, &h);
+        src = bench_frame((size_t)WIDTH * 2 * HEIGHT);
+        line = get_scratch(w * 6);
 
-    if (-1 == ioctl(fd[dev], VIDIOC_S_CTRL, &control))
-        errno_exit("VIDIOC_S_CTRL");
-#endif
+        for (i = 0; i < WIDTH * HEIGHT; i++)
+                ((unsigned short *)src)[i] &= 0x3ff;
 
-        CLEAR(fmt);
+        tonemap_name = "shift";
+        build_tonemap(10);
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        grey16_to_rgb32((unsigned short *)(src + i * WIDTH * 2), (unsigned int *)line, w);
+                        blit_line(dst + i * finfo.line_length, line, w * 4);
+                }
+                blit_flush();
+        }
+        bench_report("y10, shift", &t0, (size_t)w * h * 2);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        y10p_to_rgb32(src + i * WIDTH * 5 / 4, (unsigned int *)line,
+                                      (unsigned short *)(line + w * 4), w);
+                        blit_line(dst + i * finfo.line_length, line, w * 4);
+                }
+                blit_flush();
+        }
+        bench_report("y10p, shift", &t0, (size_t)w * h * 5 / 4);
 
-        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.width  = WIDTH;
-        fmt.fmt.pix.height = HEIGHT;
-        fmt.fmt.pix.field  = FIELD;
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        y10p_unpack(src + i * WIDTH * 5 / 4, (unsigned short *)(line + w * 4), w);
+                        blit_line(dst + i * finfo.line_length, line + w * 4, w * 2);
+                }
+        }
+        bench_report("y10p, unpack only", &t0, (size_t)w * h * 5 / 4);
+
+        /* Table lookup: -M unless that is a shift too */
+        tonemap_name = map;
+        build_tonemap(10);
+        if (tonemap_shift >= 0) {
+                tonemap_name = "gamma:2.2";
+                build_tonemap(10);
+        }
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++) {
+                for (i = 0; i < h; i++) {
+                        grey16_to_rgb32((unsigned short *)(src + i * WIDTH * 2), (unsigned int *)line, w);
+                        blit_line(dst + i * finfo.line_length, line, w * 4);
+                }
+                blit_flush();
+        }
+        bench_report("y10, lut", &t0, (size_t)w * h * 2);
+        tonemap_name = map;
+}
 
-        if (!strncmp(format_name, "uyvy", 4))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;
-        else if (!strncmp(format_name, "yuyv", 4))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-        else if (!strncmp(format_name, "rgb565", 6))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565;
-        else if (!strncmp(format_name, "rgb32", 5))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_XBGR32;
-        else if (!strncmp(format_name, "raw10", 5))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_Y10;
-        else if (!strncmp(format_name, "nv12", 4))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
-        else if (!strncmp(format_name, "nv16", 4))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV16;
-        else if (!strncmp(format_name, "bggr8", 5))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SBGGR8;
-        else if (!strncmp(format_name, "bggr12", 6))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SBGGR12;
-        else if (!strncmp(format_name, "grey", 4))
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
-        else {
-                /* Preserve original settings as set by v4l2-ctl for example */
-                if (-1 == xioctl(fd[dev], VIDIOC_G_FMT, &fmt))
-                        errno_exit("VIDIOC_G_FMT");
+/* Scalar reference of a pyramid level, checks the vector kernels */
+static int pyramid_check(const struct pyramid_format *f, const unsigned char *in,
+                         int in_stride, struct pyramid_level *lv)
+{
+        const unsigned char *r0, *r1;
+        unsigned int v;
+        int r, j, err = 0;
+
+        for (r = 0; r < lv->height; r++) {
+                r0 = in + 2 * r * in_stride;
+                r1 = r0 + in_stride;
+                for (j = 0; j < lv->width * (f->wide ? 1 : f->bpp); j++) {
+                        if (f->wide) {
+                                const unsigned short *s0 = (const unsigned short *)r0;
+                                const unsigned short *s1 = (const unsigned short *)r1;
+
+                                v = (s0[2 * j] + s0[2 * j + 1] + s1[2 * j] + s1[2 * j + 1] + 2) >> 2;
+                                if (v != ((unsigned short *)(lv->data + r * lv->stride))[j])
+                                        err++;
+                        } else {
+                                int base = 32 * (j / 16), k = j % 16;
+
+                                v = (r0[base + f->a[k]] + r0[base + f->b[k]] +
+                                     r1[base + f->a[k]] + r1[base + f->b[k]] + 2) >> 2;
+                                if (v != lv->data[r * lv->stride + j])
+                                        err++;
+                        }
+                }
         }
 
-        if (-1 == xioctl(fd[dev], VIDIOC_S_FMT, &fmt))
-                errno_exit("VIDIOC_S_FMT");
+        return err;
+}
 
-//        printf("fmt.fmt.pix.bytesperline =%d\n\n\n",fmt.fmt.pix.bytesperline);
+static void bench_pyramid(void)
+{
+        const struct pyramid_format *f = get_pyramid_format();
+        struct pyramid_level *lv;
+        const unsigned char *in;
+        unsigned char *src;
+        struct timeval t0;
+        char what[64];
+        int l, n, in_stride, err = 0;
+
+        if (!f) {
+                fprintf(stderr, "format not supported for pyramid\n");
+                exit(EXIT_FAILURE);
+        }
 
-        switch (io) {
-        case IO_METHOD_READ:
-                init_read(fmt.fmt.pix.sizeimage, dev);
-                break;
+        if (!pyramid_levels)
+                pyramid_levels = PYRAMID_MAX;
 
-        case IO_METHOD_MMAP:
-                init_mmap(dev);
-                break;
+        src = bench_frame((size_t)WIDTH * f->bpp * HEIGHT);
+        if (f->wide)
+                for (n = 0; n < WIDTH * HEIGHT; n++)
+                        ((unsigned short *)src)[n] &= 0xfff;
 
-        case IO_METHOD_USERPTR:
-                init_userp(fmt.fmt.pix.sizeimage, dev);
-                break;
+        build_pyramid(src, 0);
+        for (l = 0, in = src, in_stride = WIDTH * f->bpp; l < pyramid_levels; l++) {
+                err += pyramid_check(f, in, in_stride, &pyramid[0][l]);
+                in = pyramid[0][l].data;
+                in_stride = pyramid[0][l].stride;
+        }
+        fprintf(stderr, "pyramid check %s\n", err ? "FAILED" : "passed");
+        if (err)
+                exit(EXIT_FAILURE);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                build_pyramid(src, 0);
+        sprintf(what, "%s, %d levels, one pass", f->name, pyramid_levels);
+        bench_report(what, &t0, (size_t)WIDTH * f->bpp * HEIGHT);
+
+        /* Each level on its own, from the level above */
+        for (l = 0, in = src, in_stride = WIDTH * f->bpp; l < pyramid_levels; l++) {
+                lv = &pyramid[0][l];
+                gettimeofday(&t0, NULL);
+                for (n = 0; n < frame_count; n++)
+                        pyramid_rows(f, lv, in, in_stride, 0, lv->height);
+                sprintf(what, "%s, level %d (%dx%d)", f->name, l + 1, lv->width, lv->height);
+                bench_report(what, &t0, (size_t)in_stride * lv->height * 2);
+                in = lv->data;
+                in_stride = lv->stride;
         }
 }
 
-static void close_device(int dev)
+/* A 32 bit frame into the tile as is, the baseline for geometric stages */
+static void bench_copy(const unsigned char *src, unsigned char *dst, int w, int h)
 {
-        if (-1 == close(fd[dev]))
-                errno_exit("close");
+        int i;
 
-        fd[dev] = -1;
+        for (i = 0; i < h; i++)
+                blit_line(dst + i * finfo.line_length, src + (size_t)i * WIDTH * 4, w * 4);
+        blit_flush();
 }
 
-static void open_device(int dev)
+/* Floating point remap of one pixel, the reference for the fixed point tables */
+static unsigned int remap_reference(const struct lens *l, const unsigned char *src, int x, int y)
 {
-        struct stat st;
+        const unsigned char *s;
+        unsigned int px = 0;
+        double u, v, fx, fy;
+        int c;
+
+        if (!lens_distort(l, x, y, &u, &v))
+                return 0;
+
+        s = src + ((long)floor(v) * WIDTH + (long)floor(u)) * 4;
+        fx = u - floor(u);
+        fy = v - floor(v);
+        for (c = 0; c < 4; c++)
+                px |= (unsigned int)lrint((1 - fy) * ((1 - fx) * s[c] + fx * s[c + 4]) +
+                                          fy * ((1 - fx) * s[WIDTH * 4 + c] + fx * s[WIDTH * 4 + c + 4]))
+                      << (8 * c);
+
+        return px;
+}
 
-        if (-1 == stat(dev_name[dev], &st)) {
-                fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                         dev_name[dev], errno, strerror(errno));
-                exit(EXIT_FAILURE);
+static void bench_remap(void)
+{
+        unsigned char *src, *dst;
+        unsigned int ref, out;
+        unsigned long long sum = 0;
+        struct timeval t0;
+        char what[64];
+        int n, x, y, c, w, h, d, max = 0;
+
+        /* A moderate fisheye when no calibration is given */
+        if (LENS_NONE == lens[0].model) {
+                lens[0].model = LENS_FISHEYE;
+                lens[0].fx = lens[0].fy = WIDTH * 0.36;
+                lens[0].cx = WIDTH / 2.0;
+                lens[0].cy = HEIGHT / 2.0;
+                lens[0].k[0] = 0.02;
+                lens[0].k[1] = -0.005;
+                lens[0].scale = 1.0;
         }
 
-        if (!S_ISCHR(st.st_mode)) {
-                fprintf(stderr, "%s is no device\n", dev_name[dev]);
+        dst = bench_tile(&w, &h);
+        build_remap(0, w, h);
+
+        /* Smooth picture, like a camera's, so interpolation error is meaningful */
+        src = bench_frame((size_t)WIDTH * 4 * HEIGHT);
+        for (y = 0; y < HEIGHT; y++)
+                for (x = 0; x < WIDTH; x++)
+                        ((unsigned int *)src)[y * WIDTH + x] =
+                                (x * 255 / WIDTH) | (y * 255 / HEIGHT) << 8 |
+                                (unsigned int)lrint(128 + 100 * sin(x / 37.0) * cos(y / 23.0)) << 16;
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                remap_frame(0, src, WIDTH * 4, dst, finfo.line_length);
+        bench_report("remap, 1 thread", &t0, (size_t)w * h * 4);
+
+        start_remap(remap_threads);
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                remap_frame(0, src, WIDTH * 4, dst, finfo.line_length);
+        sprintf(what, "remap, %d threads", remap_pool + 1);
+        bench_report(what, &t0, (size_t)w * h * 4);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                bench_copy(src, dst, w, h);
+        bench_report("plain copy", &t0, (size_t)w * h * 4);
+
+        remap_frame(0, src, WIDTH * 4, dst, finfo.line_length);
+        for (y = 0; y < h; y++) {
+                for (x = 0; x < w; x++) {
+                        ref = remap_reference(&lens[0], src, x, y);
+                        memcpy(&out, dst + y * finfo.line_length + x * 4, 4);
+                        for (c = 0; c < 32; c += 8) {
+                                d = abs((int)(ref >> c & 0xff) - (int)(out >> c & 0xff));
+                                sum += d;
+                                if (d > max)
+                                        max = d;
+                        }
+                }
+        }
+        fprintf(stderr, "remap error against floating point: max %d, mean %.3f\n",
+                max, (double)sum / ((double)w * h * 4));
+        /* 1/16 pixel positions on a smooth picture */
+        if (max > 2) {
+                fprintf(stderr, "remap check FAILED\n");
                 exit(EXIT_FAILURE);
         }
 
-        fd[dev] = open(dev_name[dev], O_RDWR /* required */ | O_NONBLOCK, 0);
+        free(src);
+}
 
-        if (-1 == fd[dev]) {
-                fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                         dev_name[dev], errno, strerror(errno));
-                exit(EXIT_FAILURE);
+/* Where output pixel @x, @y of an oriented frame comes from, straight from the definition */
+static unsigned int orient_reference(const unsigned int *src, const struct orientation *o,
+                                     int x, int y)
+{
+        int ow = o->rotate % 180 ? HEIGHT : WIDTH;
+        int oh = o->rotate % 180 ? WIDTH : HEIGHT;
+
+        if (o->hflip)
+                x = ow - 1 - x;
+        if (o->vflip)
+                y = oh - 1 - y;
+
+        switch (o->rotate) {
+        case 90:
+                return src[(HEIGHT - 1 - x) * WIDTH + y];
+        case 180:
+                return src[(HEIGHT - 1 - y) * WIDTH + WIDTH - 1 - x];
+        case 270:
+                return src[x * WIDTH + WIDTH - 1 - y];
+        default:
+                return src[y * WIDTH + x];
         }
 }
 
-static void open_fb(void)
+static void bench_rotate(void)
 {
-        if (out_fb) {
-                fbfd = open(fbdev_name, O_RDWR, 0);
-                if (-1 == fbfd) {
-                        fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                                 fbdev_name, errno, strerror(errno));
-                        exit(EXIT_FAILURE);
-                }
+        static const char *spec[] = { "0", "h", "v", "180", "90", "270", "90h", "270h" };
+        struct orientation o;
+        unsigned char *src, *dst;
+        unsigned int px;
+        struct timeval t0;
+        char what[64];
+        int i, n, x, y, w, h, tw, th, err = 0;
+
+        dst = bench_tile(&tw, &th);
+        src = bench_frame((size_t)WIDTH * 4 * HEIGHT);
+
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                bench_copy(src, dst, tw, th);
+        bench_report("plain copy", &t0, (size_t)tw * th * 4);
+
+        for (i = 0; i < (int)(sizeof(spec) / sizeof(spec[0])); i++) {
+                parse_orientation(spec[i], &o);
+                w = tw;
+                h = th;
+                orient_size(&o, &w, &h);
+
+                gettimeofday(&t0, NULL);
+                for (n = 0; n < frame_count; n++)
+                        orient_frame(src, WIDTH * 4, WIDTH, HEIGHT, dst, finfo.line_length, w, h, &o);
+                blit_flush();
+                sprintf(what, "orientation %s", spec[i]);
+                bench_report(what, &t0, (size_t)w * h * 4);
+
+                for (y = 0; y < h; y++)
+                        for (x = 0; x < w; x++) {
+                                memcpy(&px, dst + y * finfo.line_length + x * 4, 4);
+                                if (px != orient_reference((unsigned int *)src, &o, x, y))
+                                        err++;
+                        }
+        }
 
-                // Get fixed screen information
-                if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) == -1) {
-                        perror("Error reading fixed information");
-                        exit(EXIT_FAILURE);
-                }
-                // Get variable screen information
-                if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
-                        perror("Error reading variable information");
-                        exit(EXIT_FAILURE);
-                }
-//                printf("%dx%d, %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+        /* The same turn reading source rows, every store a different output row */
+        parse_orientation("90", &o);
+        w = tw;
+        h = th;
+        orient_size(&o, &w, &h);
+        gettimeofday(&t0, NULL);
+        for (n = 0; n < frame_count; n++)
+                for (y = HEIGHT - w; y < HEIGHT; y++)
+                        for (x = 0; x < h; x++)
+                                ((unsigned int *)(dst + x * finfo.line_length))[HEIGHT - 1 - y] =
+                                        ((unsigned int *)src)[y * WIDTH + x];
+        bench_report("orientation 90, unblocked", &t0, (size_t)w * h * 4);
+
+        fprintf(stderr, "orientation check %s\n", err ? "FAILED" : "passed");
+        if (err)
+                exit(EXIT_FAILURE);
 
-                printf("fb0 Fixed Info:\n"
-                                "   %s  @ 0x%lx, len=%d, line=%d bytes,\n",
-                        finfo.id,
-                        finfo.smem_start,
-                        finfo.smem_len,
-                        finfo.line_length);
+        free(src);
+}
 
-                printf("   Geometry - %u x %u, %u bpp%s\n",
-                        vinfo.xres,
-                        vinfo.yres,
-                        vinfo.bits_per_pixel,
-                        vinfo.grayscale ? ", greyscale" : "");
+/* Camera-like frame: smooth gradients plus a little sensor noise */
+static unsigned char *bench_image(size_t size)
+{
+        unsigned char *buf = bench_frame(size);
+        int wide = !strncmp(format_name, "y10", 3) && strncmp(format_name, "y10p", 4);
+        size_t i, row = size / HEIGHT;
 
+        wide |= !strncmp(format_name, "y12", 3) || !strncmp(format_name, "bggr12", 6);
 
-                // Figure out the size of the screen in bytes
-                screensize = finfo.smem_len; //vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
+        if (wide) {
+                for (i = 0; i < size / 2; i++)
+                        ((unsigned short *)buf)[i] =
+                                ((i % WIDTH + i / WIDTH) * 2 + (rand() & 7)) & 0x3ff;
+        } else {
+                for (i = 0; i < size; i++)
+                        buf[i] = (i % row) / 8 + (i / row) / 4 + (rand() & 3);
+        }
 
-                // Map the device to memory
-                fbmem = (char *)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
-                if (!fbmem) {
-                        perror("Error: failed to map framebuffer device to memory");
+        return buf;
+}
+
+static void bench_compress(void)
+{
+        size_t size = frame_size(), off, n, packed;
+        unsigned char *src = bench_image(size), *dst, *out, *tmp;
+        uint32_t *clen, pred;
+        unsigned int c, chunks = (size + REC_CHUNK - 1) / REC_CHUNK;
+        struct timeval t0;
+        char what[64];
+        int i, k;
+
+        dst = malloc((size_t)chunks * LZ4_BOUND(REC_CHUNK));
+        out = malloc(size);
+        tmp = malloc(REC_CHUNK);
+        clen = malloc(chunks * sizeof(*clen));
+        if (!dst || !out || !tmp || !clen) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (k = 0; k < 2; k++) {
+                rec_predict = k;
+                pred = rec_predictor();
+
+                gettimeofday(&t0, NULL);
+                for (i = 0; i < frame_count; i++)
+                        for (c = 0, off = 0; c < chunks; c++, off += n) {
+                                n = size - off < REC_CHUNK ? size - off : REC_CHUNK;
+                                clen[c] = rec_compress_chunk(src + off, n,
+                                                             dst + (size_t)c * LZ4_BOUND(REC_CHUNK),
+                                                             tmp, pred);
+                        }
+                for (c = 0, packed = 0; c < chunks; c++)
+                        packed += clen[c] & ~REC_STORED;
+                sprintf(what, "%s%s, ratio %.2f, compress", format_name,
+                        pred ? " predicted" : "", (double)size / packed);
+                bench_report(what, &t0, size);
+
+                memset(out, 0, size);
+                gettimeofday(&t0, NULL);
+                for (i = 0; i < frame_count; i++)
+                        for (c = 0, off = 0; c < chunks; c++, off += n) {
+                                n = size - off < REC_CHUNK ? size - off : REC_CHUNK;
+                                if (rec_expand_chunk(dst + (size_t)c * LZ4_BOUND(REC_CHUNK),
+                                                     clen[c], out + off, n, tmp, pred))
+                                        break;
+                        }
+                sprintf(what, "%s%s, decompress", format_name, pred ? " predicted" : "");
+                bench_report(what, &t0, size);
+
+                if (memcmp(src, out, size)) {
+                        fprintf(stderr, "round trip FAILED\n");
                         exit(EXIT_FAILURE);
                 }
         }
+        fprintf(stderr, "round trip passed\n");
+
+        /* Incompressible data must come back too */
+        for (off = 0; off < REC_CHUNK; off++)
+                src[off] = rand();
+        clen[0] = rec_compress_chunk(src, REC_CHUNK, dst, tmp, 0);
+        if (!(clen[0] & REC_STORED) || rec_expand_chunk(dst, clen[0], out, REC_CHUNK, tmp, 0) ||
+            memcmp(src, out, REC_CHUNK)) {
+                fprintf(stderr, "stored chunk FAILED\n");
+                exit(EXIT_FAILURE);
+        }
+
+        free(src);
+        free(dst);
+        free(out);
+        free(tmp);
+        free(clen);
 }
 
-static void close_fb(void)
+static const struct {
+        const char *name;
+        void (*run)(void);
+} benchmarks[] = {
+        { "blit", bench_blit },
+        { "y10", bench_y10 },
+        { "pyramid", bench_pyramid },
+        { "compress", bench_compress },
+        { "remap", bench_remap },
+        { "rotate", bench_rotate },
+};
+
+static void run_bench(const char *name)
 {
-        if (out_fb) {
-                munmap(fbmem, screensize);
-                close(fbfd);
-                fbfd = -1;
+        unsigned int i;
+
+        for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+                if (!strcmp(name, benchmarks[i].name)) {
+                        benchmarks[i].run();
+                        return;
+                }
         }
+
+        fprintf(stderr, "unknown benchmark '%s'\n", name);
+        exit(EXIT_FAILURE);
 }
 
 static void usage(FILE *fp, char **argv)
@@ -818,7 +4755,9 @@ static void usage(FILE *fp, char **argv)
                  "-u | --userp         Use application allocated buffers\n"
                  "-o | --output        Outputs stream to stdout\n"
                  "-F | --output_fb     Outputs stream to framebuffer\n"
-                 "-f | --format        Set pixel format: uyvy, yuyv, rgb565, rgb32, nv12, nv16, bggr8, grey [%s]\n"
+                 "-f | --format        Set pixel format: uyvy, yuyv, rgb565, rgb32, nv12, nv16, bggr8, grey,\n"
+                 "                     y10, y10p, y12, raw10 (Y10 with the VSP ARGB8888 kernel patch) [%s]\n"
+                 "-M | --tonemap map   Y10/Y12 to display: shift[:bits], gamma:<g>, lut:<file> [%s]\n"
                  "-c | --count         Number of frames to grab [%i]\n"
                  "-z | --fps_count     Enable fps show\n"
                  "-s | --framerate     Set framerate\n"
@@ -827,11 +4766,39 @@ static void usage(FILE *fp, char **argv)
                  "-W | --width         Video width [%i]\n"
                  "-H | --height        Video height [%i]\n"
                  "-t | --timeout       Select timeout [%i]sec\n"
+                 "-G | --topology file  Set up media controller links and formats from file first\n"
+                 "-P | --parallel      Bring up devices concurrently\n"
+                 "-l | --timeline      Print per-device startup timeline\n"
+                 "-E | --inject d:n    Fail every n-th capture on device d to test recovery\n"
+                 "-i | --replay file   Play frames recorded with -o instead of capturing (uses -f/-W/-H)\n"
+                 "-I | --replay_fps n  Replay rate, 0 = as fast as possible [-s or 30]\n"
+                 "-p | --pyramid n     Build n (1-3) levels of 1/2, 1/4, 1/8 scale copies\n"
+                 "-O | --output_level l  Output pyramid level l (1 to -p n) instead of the frame with -o\n"
+                 "-Z | --compress file Record frames losslessly compressed to file\n"
+                 "-U | --decompress file  Write the frames of a -Z recording to stdout and exit\n"
+                 "-k | --workers n     Compression threads with -Z [online CPUs]\n"
+                 "-K | --predict       Delta-code samples before compression with -Z\n"
+                 "-g | --rate spec     Frames per output (buf, fb, rec, pyr): out/n every n-th, out@fps,\n"
+                 "                     d:out... for device d only, e.g. fb@10,rec/1,3:fb/2\n"
+                 "-q | --orient d:o,.. Rotate/mirror device d on the framebuffer: 90, 180, 270 clockwise,\n"
+                 "                     then h and/or v flips, e.g. 0:90,1:h,2:270v\n"
+                 "-C | --calib file    Undistort cameras on the framebuffer with lens calibrations from file\n"
+                 "-N | --remap_threads n  Threads for -C [online CPUs]\n"
+                 "-x | --rt prio       Real-time mode: lock and prefault memory, SCHED_FIFO priority\n"
+                 "-a | --affinity cpus CPUs for the capture loop with -x, e.g. 0,2-3\n"
+                 "-e | --trace out     Trace each frame stage to out: ftrace (trace_marker) or a JSON file\n"
+                 "-j | --jitter        Report dequeue interval jitter at exit\n"
+                 "-y | --stress n      Run n threads of synthetic CPU/memory load\n"
+                 "-B | --bench name    Run a benchmark instead of capturing: blit, y10, pyramid,\n                     compress, remap, rotate\n"
+                 "-R | --daemon file   Keep streaming and read commands from file (FIFO or - for stdin),\n"
+                 "                     -c is ignored. Commands: camera <n> <device>, crop <l> <t> <w> <h>,\n"
+                 "                     format <name>, framerate <fps>, orient <n> <o>, rate <spec>,\n"
+                 "                     record on|off, start, stop, quit\n"
                  "",
-                 argv[0], dev_name[0], n_devs, format_name, frame_count, LEFT, TOP, WIDTH, HEIGHT, timeout);
+                 argv[0], dev_name[0], n_devs, format_name, tonemap_name, frame_count, LEFT, TOP, WIDTH, HEIGHT, timeout);
 }
 
-static const char short_options[] = "d:D:hmruoFf:c:zs:L:T:W:H:t:";
+static const char short_options[] = "d:D:hmruoFf:c:zs:L:T:W:H:t:R:PlE:B:M:x:a:jy:p:O:i:I:Z:U:k:Ke:C:N:q:g:G:";
 
 static const struct option
 long_options[] = {
@@ -852,11 +4819,37 @@ long_options[] = {
         { "width",  required_argument, NULL, 'W' },
         { "height",  required_argument, NULL, 'H' },
         { "timeout",  required_argument, NULL, 't' },
+        { "daemon",  required_argument, NULL, 'R' },
+        { "parallel",  no_argument,    NULL, 'P' },
+        { "timeline",  no_argument,    NULL, 'l' },
+        { "inject",  required_argument, NULL, 'E' },
+        { "bench",  required_argument, NULL, 'B' },
+        { "tonemap",  required_argument, NULL, 'M' },
+        { "replay",  required_argument, NULL, 'i' },
+        { "replay_fps",  required_argument, NULL, 'I' },
+        { "pyramid",  required_argument, NULL, 'p' },
+        { "output_level",  required_argument, NULL, 'O' },
+        { "rt",  required_argument, NULL, 'x' },
+        { "affinity",  required_argument, NULL, 'a' },
+        { "jitter",  no_argument,      NULL, 'j' },
+        { "stress",  required_argument, NULL, 'y' },
+        { "compress",  required_argument, NULL, 'Z' },
+        { "decompress",  required_argument, NULL, 'U' },
+        { "workers",  required_argument, NULL, 'k' },
+        { "predict",  no_argument,     NULL, 'K' },
+        { "trace",  required_argument, NULL, 'e' },
+        { "calib",  required_argument, NULL, 'C' },
+        { "remap_threads",  required_argument, NULL, 'N' },
+        { "orient",  required_argument, NULL, 'q' },
+        { "rate",  required_argument, NULL, 'g' },
+        { "topology",  required_argument, NULL, 'G' },
         { 0, 0, 0, 0 }
 };
 
 int main(int argc, char **argv)
 {
+        struct orientation o;
+        char *s, arg[16];
         int dev;
         dev_name[0] = "/dev/video0";
         fbdev_name = "/dev/fb0";
@@ -968,22 +4961,228 @@ int main(int argc, char **argv)
                                 errno_exit(optarg);
                         break;
 
+                case 'R':
+                        daemon_mode = 1;
+                        cmd_name = optarg;
+                        break;
+
+                case 'P':
+                        parallel_start = 1;
+                        break;
+
+                case 'l':
+                        show_timeline = 1;
+                        break;
+
+                case 'i':
+                        replay_name = optarg;
+                        break;
+
+                case 'I':
+                        errno = 0;
+                        replay_fps = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        break;
+
+                case 'Z':
+                        rec_name = optarg;
+                        break;
+
+                case 'U':
+                        unpack_name = optarg;
+                        break;
+
+                case 'k':
+                        errno = 0;
+                        rec_workers = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        break;
+
+                case 'K':
+                        rec_predict = 1;
+                        break;
+
+                case 'e':
+                        trace_name = optarg;
+                        break;
+
+                case 'C':
+                        calib_name = optarg;
+                        break;
+
+                case 'G':
+                        topology_name = optarg;
+                        break;
+
+                case 'g':
+                        if (parse_rates(optarg)) {
+                                usage(stderr, argv);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
+                case 'q':
+                        for (s = strtok(optarg, ","); s; s = strtok(NULL, ",")) {
+                                if (2 != sscanf(s, "%d:%15s", &dev, arg) || dev < 0 ||
+                                    dev >= N_DEVS_MAX || parse_orientation(arg, &o)) {
+                                        usage(stderr, argv);
+                                        exit(EXIT_FAILURE);
+                                }
+                                orient[dev] = o;
+                        }
+                        break;
+
+                case 'N':
+                        errno = 0;
+                        remap_threads = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        break;
+
+                case 'p':
+                        errno = 0;
+                        pyramid_levels = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        if (pyramid_levels < 0 || pyramid_levels > PYRAMID_MAX) {
+                                usage(stderr, argv);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
+                case 'O':
+                        errno = 0;
+                        pyramid_out = strtol(optarg, NULL, 0) - 1;
+                        if (errno)
+                                errno_exit(optarg);
+                        if (pyramid_out < 0) {
+                                usage(stderr, argv);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
+                case 'x':
+                        errno = 0;
+                        rt_prio = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        break;
+
+                case 'a':
+                        rt_cpus = optarg;
+                        break;
+
+                case 'j':
+                        jitter = 1;
+                        break;
+
+                case 'y':
+                        errno = 0;
+                        stress_threads = strtol(optarg, NULL, 0);
+                        if (errno)
+                                errno_exit(optarg);
+                        break;
+
+                case 'M':
+                        tonemap_name = optarg;
+                        break;
+
+                case 'B':
+                        bench_name = optarg;
+                        break;
+
+                case 'E':
+                        if (2 != sscanf(optarg, "%d:%u", &inject_dev, &inject_period) ||
+                            !inject_period) {
+                                usage(stderr, argv);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
                 default:
                         usage(stderr, argv);
                         exit(EXIT_FAILURE);
                 }
         }
 
-        for (dev = 0; dev < n_devs; dev++) {
-                open_device(dev);
-                init_device(dev);
-                start_capturing(dev);
+        /* -O picks one of the -p levels, whichever came first */
+        if (pyramid_out >= pyramid_levels) {
+                usage(stderr, argv);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Catch a bad tone mapping before any device is started */
+        build_tonemap(grey_bits());
+        if (calib_name)
+                load_calibration(calib_name);
+
+        if (bench_name) {
+                run_bench(bench_name);
+                return 0;
+        }
+
+        if (unpack_name) {
+                decompress();
+                return 0;
         }
+
+        if (jitter) {
+                for (dev = 0; dev < n_devs; dev++) {
+                        jitter_hist[dev] = calloc(JITTER_BINS, sizeof(*jitter_hist[dev]));
+                        if (!jitter_hist[dev]) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        }
+
+        start_stress();
+        /* Before setup_rt(), the workers stay on normal priority */
+        start_recording();
+        if (trace_name)
+                open_trace(trace_name);
+
+        if (replay_name) {
+                open_fb();
+                if (rt_prio)
+                        setup_rt();
+                /* After setup_rt(), the helpers run at the loop's priority */
+                setup_remap();
+                replay();
+                close_trace();
+                stop_recording();
+                close_fb();
+                print_rates();
+                print_jitter();
+                return 0;
+        }
+
+        if (topology_name)
+                media_setup(topology_name);
+        start_devices();
         open_fb();
+        open_cmd();
+        if (rt_prio)
+                setup_rt();
+        setup_remap();
         mainloop();
+        close_trace();
+        stop_recording();
+        join_devices();
+        if (show_timeline && first_frames < n_devs)
+                print_timeline();
+        close_cmd();
         close_fb();
+        print_outages();
+        print_rates();
+        print_jitter();
         for (dev = 0; dev < n_devs; dev++) {
-                stop_capturing(dev);
+                if (-1 == fd[dev])
+                        continue;
+                if (streaming[dev])
+                        stop_capturing(dev);
                 uninit_device(dev);
                 close_device(dev);
         }
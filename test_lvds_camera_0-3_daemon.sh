@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# this is FB based test
+# same as test_lvds_camera_0-3.sh, but cameras are switched at runtime
+killall weston
+killall capture
+
+FIFO=/tmp/capture.cmd
+rm -f $FIFO
+mkfifo $FIFO
+
+capture -d /dev/video0 -F -f rgb32 -L 0 -T 0 -W 1280 -H 800 -z -R $FIFO &
+
+# count = 30fps*3sec
+while true; do
+for n in 0 1 2 3; do
+echo "camera 0 /dev/video$n" > $FIFO
+sleep 3
+done
+done
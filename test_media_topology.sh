@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# media controller bring-up time: the media-ctl sequence from readme.txt
+# against capture -G with the same links and formats
+killall weston
+killall capture
+
+media_ctl_setup() {
+media-ctl -d /dev/media0 -l "'rcar_csi2 feaa0000.csi2':1 -> 'VIN0 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 feaa0000.csi2':2 -> 'VIN1 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 feaa0000.csi2':3 -> 'VIN2 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 feaa0000.csi2':4 -> 'VIN3 output':0 [1]"
+media-ctl -d /dev/media0 -V "'rcar_csi2 feaa0000.csi2':1 [fmt:Y10_1X10/1920x1020 field:none]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed60000.csi2':1 -> 'VIN16 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed60000.csi2':2 -> 'VIN17 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed60000.csi2':3 -> 'VIN18 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed60000.csi2':4 -> 'VIN19 output':0 [1]"
+media-ctl -d /dev/media0 -V "'rcar_csi2 fed60000.csi2':1 [fmt:Y10_1X10/1920x1020 field:none]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed70000.csi2':1 -> 'VIN24 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed70000.csi2':2 -> 'VIN25 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed70000.csi2':3 -> 'VIN26 output':0 [1]"
+media-ctl -d /dev/media0 -l "'rcar_csi2 fed70000.csi2':4 -> 'VIN27 output':0 [1]"
+media-ctl -d /dev/media0 -V "'rcar_csi2 fed70000.csi2':1 [fmt:Y10_1X10/1920x1020 field:none]"
+}
+
+media-ctl -d /dev/media0 -r
+start=$(date +%s%N)
+media_ctl_setup
+end=$(date +%s%N)
+echo "=== media-ctl: $(( (end - start) / 1000 )) us"
+
+echo "=== capture -G"
+media-ctl -d /dev/media0 -r
+capture -G falcon_gmsl.topology -D 12 -f raw10 -L 480 -T 180 -W 480 -H 360 -c 1
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+# this is FB based test
+# dequeue jitter under synthetic CPU/memory load, without and with real-time mode
+killall weston
+killall capture
+
+LOAD=4
+
+echo "=== normal, $LOAD load threads"
+capture -D 4 -F -f rgb32 -L 160 -T 130 -W 960 -H 540 -c 1000 -j -y $LOAD
+
+echo "=== real-time (SCHED_FIFO 80 on CPU 1), $LOAD load threads"
+capture -D 4 -F -f rgb32 -L 160 -T 130 -W 960 -H 540 -c 1000 -j -y $LOAD -x 80 -a 1
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# tracing check, no camera needed: trace a short replay and verify the JSON
+# is well formed and every stage that begins also ends, in order, per device
+CAPTURE=${CAPTURE:-capture}
+W=640
+H=480
+FRAMES=20
+DEVS=2
+
+head -c $((W * H * 2 * 4)) /dev/urandom > /tmp/trace_test.uyvy
+$CAPTURE -i /tmp/trace_test.uyvy -f uyvy -W $W -H $H -D $DEVS -c $FRAMES -I 0 -p 2 \
+        -e /tmp/trace_test.json || exit 1
+
+python3 - /tmp/trace_test.json $((FRAMES * DEVS)) <<'END'
+import json, sys
+
+events = json.load(open(sys.argv[1]))["traceEvents"]
+stacks, frames = {}, 0
+for e in events:
+    if e["ph"] == "B":
+        stacks.setdefault(e["tid"], []).append(e)
+    elif e["ph"] == "E":
+        b = stacks[e["tid"]].pop()
+        assert b["name"] == e["name"] and b["ts"] <= e["ts"], (b, e)
+        frames += e["name"] == "process"
+assert not any(stacks.values()), "unterminated stages"
+assert frames == int(sys.argv[2]), "%d frames traced" % frames
+print("trace OK: %d events, %d frames" % (len(events), frames))
+END
@@ -0,0 +1,46 @@
+#!/bin/sh
+
+# media controller setup on the vimc virtual media driver, no camera needed:
+# capture -G vimc.topology has to stream from vimc's raw capture node, and a
+# -f/-W the sensor doesn't give has to stop it before streaming
+CAPTURE=${CAPTURE:-capture}
+TOPOLOGY=/tmp/vimc_test.topology
+
+modprobe vimc || exit 1
+sleep 1
+
+for m in /sys/bus/media/devices/media*; do
+        [ "$(cat $m/model)" = "VIMC MDEV" ] && MEDIA=/dev/${m##*/}
+done
+for v in /sys/class/video4linux/video*; do
+        [ "$(cat $v/name)" = "Raw Capture 0" ] && DEV=/dev/${v##*/}
+done
+if [ -z "$MEDIA" ] || [ -z "$DEV" ]; then
+        echo "FAIL: vimc media or capture device not found"
+        exit 1
+fi
+
+# vimc.topology, on whichever media device vimc got
+sed "s|^media .*|media $MEDIA|" vimc.topology > $TOPOLOGY
+
+echo "=== $DEV bggr8 640x480"
+if ! $CAPTURE -G $TOPOLOGY -d $DEV -f bggr8 -W 640 -H 480 -c 30; then
+        echo "FAIL: capture -G vimc.topology"
+        exit 1
+fi
+
+echo "=== $DEV bggr8 1280x480, wider than the sensor"
+if $CAPTURE -G $TOPOLOGY -d $DEV -f bggr8 -W 1280 -H 480 -c 30 2>&1 | tee /dev/stderr | \
+   grep -q "too small"; then :; else
+        echo "FAIL: size mismatch not caught"
+        exit 1
+fi
+
+echo "=== $DEV uyvy 640x480, from a Bayer sensor"
+if $CAPTURE -G $TOPOLOGY -d $DEV -f uyvy -W 640 -H 480 -c 30 2>&1 | tee /dev/stderr | \
+   grep -q "no uyvy"; then :; else
+        echo "FAIL: format mismatch not caught"
+        exit 1
+fi
+
+echo "PASS"